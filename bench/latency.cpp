@@ -0,0 +1,105 @@
+/**
+ * @file latency.cpp
+ * @brief Round-trip latency of tools/call against a running server
+ *
+ * Sends one POST /message per connection (the server closes after each
+ * exchange), one at a time, and prints latency percentiles. Compare a
+ * server started normally with one started with --low-latency:
+ *
+ *   ./build/CustomMCP 3000 --io-cpus=2 &
+ *   ./build/bench_latency 127.0.0.1 3000 100000
+ *
+ * Run the client on a different core than the server's io threads, or the
+ * two take turns on one core and the busy-polling server looks slower.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+bool round_trip(const sockaddr_in& address, const std::string& request) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    bool ok = ::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0 &&
+              ::send(fd, request.data(), request.size(), 0) == static_cast<ssize_t>(request.size());
+    char buffer[4096];
+    size_t received = 0;
+    while (ok) {
+        ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0) {
+            break;
+        }
+        received += static_cast<size_t>(n);
+    }
+    ::close(fd);
+    return ok && received > 0;
+}
+
+double percentile(const std::vector<double>& sorted, double p) {
+    size_t index = static_cast<size_t>(p / 100.0 * static_cast<double>(sorted.size() - 1));
+    return sorted[index];
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const char* host = argc > 1 ? argv[1] : "127.0.0.1";
+    int port = argc > 2 ? std::atoi(argv[2]) : 3000;
+    size_t count = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 20000;
+    size_t warmup = std::max<size_t>(count / 10, 100);
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    if (::inet_pton(AF_INET, host, &address.sin_addr) != 1) {
+        std::fprintf(stderr, "Invalid address: %s\n", host);
+        return 1;
+    }
+
+    std::string body = R"({"jsonrpc":"2.0","id":1,"method":"tools/call","params":{"name":"echo","arguments":{"text":"hi"}}})";
+    std::string request = "POST /message HTTP/1.1\r\nHost: " + std::string(host) +
+                          "\r\nContent-Type: application/json\r\nContent-Length: " +
+                          std::to_string(body.size()) + "\r\n\r\n" + body;
+
+    std::vector<double> samples;
+    samples.reserve(count);
+    size_t failures = 0;
+    for (size_t i = 0; i < warmup + count; ++i) {
+        Clock::time_point start = Clock::now();
+        bool ok = round_trip(address, request);
+        double us = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+        if (!ok) {
+            failures++;
+        } else if (i >= warmup) {
+            samples.push_back(us);
+        }
+    }
+    if (samples.empty()) {
+        std::fprintf(stderr, "No successful requests\n");
+        return 1;
+    }
+
+    std::sort(samples.begin(), samples.end());
+    std::printf("requests %zu, failures %zu\n", samples.size(), failures);
+    std::printf("p50 %.1f us  p99 %.1f us  p99.9 %.1f us  p99.99 %.1f us  max %.1f us\n",
+                percentile(samples, 50), percentile(samples, 99), percentile(samples, 99.9),
+                percentile(samples, 99.99), samples.back());
+    return 0;
+}
@@ -0,0 +1,97 @@
+/**
+ * @file text_kernels.cpp
+ * @brief Throughput of the UTF-8 check and JSON escape scan, per kernel
+ *
+ * Compiles the server source without its main() and times each kernel
+ * the CPU supports over the same buffers, next to the scalar code and
+ * nlohmann's dump() of the same string:
+ *
+ *   ./build/bench_text_kernels        # 16 MiB buffers
+ *   ./build/bench_text_kernels 64     # 64 MiB buffers
+ */
+
+#define CUSTOMMCP_NO_MAIN
+#include "../src/main.cpp"
+
+namespace {
+
+using BenchClock = std::chrono::steady_clock;
+
+/**
+ * @brief Best of several runs, in GB/s
+ */
+template<typename Fn>
+double throughput(size_t bytes, Fn&& fn) {
+    double best = 0;
+    for (int run = 0; run < 5; ++run) {
+        BenchClock::time_point start = BenchClock::now();
+        fn();
+        double seconds = std::chrono::duration<double>(BenchClock::now() - start).count();
+        best = std::max(best, static_cast<double>(bytes) / seconds / 1e9);
+    }
+    return best;
+}
+
+// Keeps results alive so the calls are not optimized away
+volatile size_t sink;
+
+void report(const char* what, const char* kernel, double gbps) {
+    std::printf("%-22s %-8s %7.2f GB/s\n", what, kernel, gbps);
+}
+
+void bench_utf8(const char* what, const std::string& text) {
+    const auto* p = reinterpret_cast<const unsigned char*>(text.data());
+    size_t n = text.size();
+    report(what, "scalar", throughput(n, [&] { sink = utf8_valid_scalar(p, p + n); }));
+#if defined(MCP_SIMD_X86)
+    report(what, "sse2", throughput(n, [&] { sink = utf8_valid_sse2(p, p + n); }));
+    if (__builtin_cpu_supports("avx2")) {
+        report(what, "avx2", throughput(n, [&] { sink = Utf8ValidatorAvx2::validate(p, n); }));
+    }
+#endif
+}
+
+void bench_escape(const char* what, const std::string& text) {
+    const char* p = text.data();
+    size_t n = text.size();
+    report(what, "scalar", throughput(n, [&] { sink = json_escape_scan_scalar(p, n); }));
+#if defined(MCP_SIMD_X86)
+    report(what, "sse2", throughput(n, [&] { sink = json_escape_scan_sse2(p, n); }));
+    if (__builtin_cpu_supports("avx2")) {
+        report(what, "avx2", throughput(n, [&] { sink = json_escape_scan_avx2(p, n); }));
+    }
+#endif
+    json value = text;
+    report(what, "dump()", throughput(n, [&] { sink = value.dump().size(); }));
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    size_t mib = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 16;
+    size_t size = mib << 20;
+    std::printf("selected kernel: %s\n", TextKernels::get().name);
+
+    std::mt19937 rng(42);
+    std::string ascii(size, ' ');
+    for (auto& c : ascii) {
+        // Printable ASCII without anything the escape scan stops at
+        c = static_cast<char>(' ' + rng() % 95);
+        if (c == '"' || c == '\\') {
+            c = 'x';
+        }
+    }
+    std::string cjk;
+    cjk.reserve(size);
+    while (cjk.size() + 3 <= size) {
+        uint32_t cp = 0x4E00 + rng() % 0x5000;
+        cjk += static_cast<char>(0xE0 | (cp >> 12));
+        cjk += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        cjk += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+
+    bench_utf8("utf8_valid ascii", ascii);
+    bench_utf8("utf8_valid cjk", cjk);
+    bench_escape("json_escape_scan", ascii);
+    return 0;
+}
@@ -0,0 +1,80 @@
+/**
+ * @file url_decode.cpp
+ * @brief Cost of decoding a request's query string
+ *
+ * Compiles the server source without its main() and compares, on a
+ * query with a few escapes, the earlier istringstream-per-escape
+ * decoder, url_decode() and parsing the whole query with QueryString:
+ *
+ *   ./build/bench_url_decode             # 1,000,000 iterations
+ *   ./build/bench_url_decode 5000000
+ */
+
+#define CUSTOMMCP_NO_MAIN
+#include "../src/main.cpp"
+
+namespace {
+
+using BenchClock = std::chrono::steady_clock;
+
+/**
+ * @brief The decoder url_decode() replaced, kept as the baseline
+ */
+std::string url_decode_stream(const std::string& str) {
+    std::string result;
+    for (size_t i = 0; i < str.length(); ++i) {
+        if (str[i] == '%' && i + 2 < str.length()) {
+            int value;
+            std::istringstream is(str.substr(i + 1, 2));
+            if (is >> std::hex >> value) {
+                result += static_cast<char>(value);
+                i += 2;
+            } else {
+                result += str[i];
+            }
+        } else if (str[i] == '+') {
+            result += ' ';
+        } else {
+            result += str[i];
+        }
+    }
+    return result;
+}
+
+volatile size_t sink;
+
+template<typename Fn>
+void report(const char* what, size_t iterations, Fn&& fn) {
+    BenchClock::time_point start = BenchClock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        fn();
+    }
+    double ns = std::chrono::duration<double, std::nano>(BenchClock::now() - start).count();
+    std::printf("%-20s %8.1f ns/op\n", what, ns / static_cast<double>(iterations));
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    size_t iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+    std::printf("selected kernel: %s\n", TextKernels::get().name);
+
+    // A long-ish query: session ID, a cursor token and a path with escapes
+    std::string query = "sessionId=0001a3f09c2b7d4e5f60718293a4b5c6"
+                        "&cursor=eyJvZmZzZXQiOjQwOTYsInRvb2wiOiJyZWFkX2ZpbGUiLCJwYWdlIjozfQ"
+                        "&path=%2Fhome%2Fuser%2Fprojects%2Fsimple-mcp-server%2Fsrc%2Fmain.cpp"
+                        "&filter=name+contains+parse_http_method+and+weight+at+least+ten";
+    if (url_decode(query) != url_decode_stream(query)) {
+        std::fprintf(stderr, "url_decode() and the baseline disagree\n");
+        return 1;
+    }
+
+    report("istringstream", iterations, [&] { sink = url_decode_stream(query).size(); });
+    report("url_decode", iterations, [&] { sink = url_decode(query).size(); });
+    QueryString parsed;     // reused, as a session reuses its own
+    report("QueryString::parse", iterations, [&] {
+        parsed.parse(query);
+        sink = parsed.get("sessionId").size();
+    });
+    return 0;
+}
@@ -4,659 +4,8033 @@
 #include <sstream>
 #include <unordered_map>
 #include <functional>
+#include <algorithm>
+#include <iterator>
+#include <list>
+#include <memory_resource>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <random>
+#include <shared_mutex>
+#include <stdexcept>
+#include <system_error>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
 #include <nlohmann/json.hpp>
 #include <asio.hpp>
 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 using json = nlohmann::json;
 using asio::ip::tcp;
-
-std::string url_decode(const std::string& str) {
-    std::string result;
-    for (size_t i = 0; i < str.length(); ++i) {
-        if (str[i] == '%' && i + 2 < str.length()) {
-            int value;
-            std::istringstream is(str.substr(i + 1, 2));
-            if (is >> std::hex >> value) {
-                result += static_cast<char>(value);
-                i += 2;
-            } else {
-                result += str[i];
-            }
-        } else if (str[i] == '+') {
-            result += ' ';
-        } else {
-            result += str[i];
-        }
-    }
-    return result;
-}
+using Clock = std::chrono::steady_clock;
 
 // ============================================================================
-// Tool System
+// Text Encoding
 // ============================================================================
+//
+// JSON string escaping, UTF-8 validation and URL decoding sit on the request
+// and response paths, so their scanning loops come in three flavours: AVX2
+// (picked at runtime when the CPU has it), SSE2 (always present on x86-64)
+// and scalar.
+// The SIMD paths need GCC or Clang for per-function target attributes.
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define MCP_SIMD_X86 1
+#define MCP_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
 
 /**
- * @brief Represents a property in the tool's input schema
+ * @brief Check if a byte must be escaped inside a JSON string
  */
-struct ToolProperty {
-    std::string name;
-    std::string type;
-    std::string description;
-    bool required = false;
-    
-    ToolProperty(const std::string& n, const std::string& t, const std::string& d, bool req = false)
-        : name(n), type(t), description(d), required(req) {}
-};
+inline bool json_needs_escape(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+inline size_t url_special_scan_scalar(const char* data, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        if (data[i] == '%' || data[i] == '+') {
+            return i;
+        }
+    }
+    return length;
+}
+
+inline size_t json_escape_scan_scalar(const char* data, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        if (json_needs_escape(static_cast<unsigned char>(data[i]))) {
+            return i;
+        }
+    }
+    return length;
+}
 
 /**
- * @brief Base class for MCP tools
+ * @brief Length of the well-formed UTF-8 sequence starting at p, or 0 if it is not
  * 
- * To create a new tool, inherit from this class and implement:
- * - getName(): Return the tool's unique name
- * - getDescription(): Return a description of what the tool does
- * - getProperties(): Return the input schema properties
- * - execute(): Implement the tool's logic
+ * Rejects overlongs, surrogates and values past U+10FFFF.
  */
-class Tool {
-public:
-    virtual ~Tool() = default;
-    
-    /**
-     * @brief Get the unique name of the tool
-     */
-    virtual std::string getName() const = 0;
+inline size_t utf8_sequence_length(const unsigned char* p, const unsigned char* end) {
+    unsigned char c = *p;
+    if (c < 0x80) {
+        return 1;
+    }
     
-    /**
-     * @brief Get a description of what the tool does
-     */
-    virtual std::string getDescription() const = 0;
+    size_t length;
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) {
+        length = 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        length = 3;
+        if (c == 0xE0) lo = 0xA0;
+        if (c == 0xED) hi = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        length = 4;
+        if (c == 0xF0) lo = 0x90;
+        if (c == 0xF4) hi = 0x8F;
+    } else {
+        return 0;
+    }
     
-    /**
-     * @brief Get the input schema properties for the tool
-     */
-    virtual std::vector<ToolProperty> getProperties() const = 0;
+    if (static_cast<size_t>(end - p) < length || p[1] < lo || p[1] > hi) {
+        return 0;
+    }
+    for (size_t i = 2; i < length; ++i) {
+        if ((p[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+    }
+    return length;
+}
+
+inline bool utf8_valid_scalar(const unsigned char* p, const unsigned char* end) {
+    while (p < end) {
+        size_t length = utf8_sequence_length(p, end);
+        if (length == 0) {
+            return false;
+        }
+        p += length;
+    }
+    return true;
+}
+
+#if defined(MCP_SIMD_X86)
+
+inline size_t json_escape_scan_sse2(const char* data, size_t length) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control_max = _mm_set1_epi8(0x1F);
     
-    /**
-     * @brief Execute the tool with the given arguments
-     * @param arguments JSON object containing the tool arguments
-     * @return JSON result to be sent back to the client
-     */
-    virtual json execute(const json& arguments) = 0;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        // v <= 0x1F (unsigned) exactly when min(v, 0x1F) == v
+        __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(v, control_max), v);
+        __m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash));
+        int mask = _mm_movemask_epi8(_mm_or_si128(control, special));
+        if (mask != 0) {
+            return i + __builtin_ctz(static_cast<unsigned>(mask));
+        }
+    }
+    return i + json_escape_scan_scalar(data + i, length - i);
+}
+
+MCP_TARGET_AVX2 inline size_t json_escape_scan_avx2(const char* data, size_t length) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control_max = _mm256_set1_epi8(0x1F);
     
-    /**
-     * @brief Generate the JSON schema for tools/list response
-     */
-    json getSchema() const {
-        json properties = json::object();
-        json required_props = json::array();
-        
-        for (const auto& prop : getProperties()) {
-            properties[prop.name] = {
-                {"type", prop.type},
-                {"description", prop.description}
-            };
-            if (prop.required) {
-                required_props.push_back(prop.name);
-            }
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(v, control_max), v);
+        __m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_or_si256(control, special)));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
         }
-        
-        return {
-            {"name", getName()},
-            {"description", getDescription()},
-            {"inputSchema", {
-                {"type", "object"},
-                {"properties", properties},
-                {"required", required_props}
-            }}
-        };
     }
+    return i + json_escape_scan_sse2(data + i, length - i);
+}
+
+inline size_t url_special_scan_sse2(const char* data, size_t length) {
+    const __m128i percent = _mm_set1_epi8('%');
+    const __m128i plus = _mm_set1_epi8('+');
     
-protected:
-    /**
-     * @brief Helper to create a text content response
-     */
-    static json createTextContent(const std::string& text) {
-        return {
-            {"content", json::array({
-                {
-                    {"type", "text"},
-                    {"text", text}
-                }
-            })}
-        };
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, percent), _mm_cmpeq_epi8(v, plus)));
+        if (mask != 0) {
+            return i + __builtin_ctz(static_cast<unsigned>(mask));
+        }
     }
+    return i + url_special_scan_scalar(data + i, length - i);
+}
+
+MCP_TARGET_AVX2 inline size_t url_special_scan_avx2(const char* data, size_t length) {
+    const __m256i percent = _mm256_set1_epi8('%');
+    const __m256i plus = _mm256_set1_epi8('+');
     
-    /**
-     * @brief Helper to create an error response
-     */
-    static json createErrorContent(const std::string& error) {
-        return {
-            {"content", json::array({
-                {
-                    {"type", "text"},
-                    {"text", "Error: " + error}
-                }
-            })},
-            {"isError", true}
-        };
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, percent), _mm256_cmpeq_epi8(v, plus))));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
     }
-};
+    return i + url_special_scan_sse2(data + i, length - i);
+}
 
 /**
- * @brief Registry for managing MCP tools
+ * @brief SSE2 UTF-8 check: skips ASCII 16 bytes at a time, scalar otherwise
+ */
+inline bool utf8_valid_sse2(const unsigned char* p, const unsigned char* end) {
+    while (p < end) {
+        if (end - p >= 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            if (_mm_movemask_epi8(v) == 0) {
+                p += 16;
+                continue;
+            }
+        }
+        size_t length = utf8_sequence_length(p, end);
+        if (length == 0) {
+            return false;
+        }
+        p += length;
+    }
+    return true;
+}
+
+/**
+ * @brief AVX2 UTF-8 check using the lookup algorithm of Keiser and Lemire,
+ * "Validating UTF-8 In Less Than One Instruction Per Byte" (2021)
  * 
- * Use this class to register tools and retrieve them by name.
- * This is a singleton - use ToolRegistry::instance() to access it.
+ * Each byte is classified by three 16-entry tables indexed by the high and
+ * low nibble of the previous byte and the high nibble of the current one;
+ * the AND of the three lookups is non-zero exactly for invalid pairs.
+ * Three- and four-byte sequences are checked via the bytes two and three
+ * positions back.
  */
-class ToolRegistry {
+class Utf8ValidatorAvx2 {
 public:
-    static ToolRegistry& instance() {
-        static ToolRegistry registry;
-        return registry;
-    }
-    
-    /**
-     * @brief Register a tool with the registry
-     * @param tool Shared pointer to the tool instance
-     */
-    void registerTool(std::shared_ptr<Tool> tool) {
-        tools_[tool->getName()] = tool;
-        std::cout << "Registered tool: " << tool->getName() << std::endl;
+    MCP_TARGET_AVX2 static bool validate(const unsigned char* p, size_t length) {
+        __m256i error = _mm256_setzero_si256();
+        __m256i prev_input = _mm256_setzero_si256();
+        __m256i prev_incomplete = _mm256_setzero_si256();
+        
+        size_t i = 0;
+        for (; i + 32 <= length; i += 32) {
+            __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+            check_block(input, prev_input, prev_incomplete, error);
+        }
+        if (i < length) {
+            // Zero padding is ASCII, so it cannot hide or cause an error
+            alignas(32) unsigned char tail[32] = {};
+            std::memcpy(tail, p + i, length - i);
+            __m256i input = _mm256_load_si256(reinterpret_cast<const __m256i*>(tail));
+            check_block(input, prev_input, prev_incomplete, error);
+        }
+        
+        error = _mm256_or_si256(error, prev_incomplete);
+        return _mm256_testz_si256(error, error) != 0;
     }
     
-    /**
-     * @brief Register a tool by creating it in place
-     * @tparam T The tool class type
-     * @tparam Args Constructor argument types
-     * @param args Constructor arguments
-     */
-    template<typename T, typename... Args>
-    void registerTool(Args&&... args) {
-        auto tool = std::make_shared<T>(std::forward<Args>(args)...);
-        registerTool(tool);
-    }
+private:
+    static constexpr uint8_t TOO_SHORT = 1 << 0;
+    static constexpr uint8_t TOO_LONG = 1 << 1;
+    static constexpr uint8_t OVERLONG_3 = 1 << 2;
+    static constexpr uint8_t TOO_LARGE = 1 << 3;
+    static constexpr uint8_t SURROGATE = 1 << 4;
+    static constexpr uint8_t OVERLONG_2 = 1 << 5;
+    static constexpr uint8_t TOO_LARGE_1000 = 1 << 6;
+    static constexpr uint8_t OVERLONG_4 = 1 << 6;
+    static constexpr uint8_t TWO_CONTS = 1 << 7;
+    static constexpr uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
     
-    /**
-     * @brief Get a tool by name
-     * @param name The tool name
-     * @return Shared pointer to the tool, or nullptr if not found
-     */
-    std::shared_ptr<Tool> getTool(const std::string& name) const {
-        auto it = tools_.find(name);
-        if (it != tools_.end()) {
-            return it->second;
-        }
-        return nullptr;
+    MCP_TARGET_AVX2 static __m256i table(uint8_t t0, uint8_t t1, uint8_t t2, uint8_t t3,
+                                         uint8_t t4, uint8_t t5, uint8_t t6, uint8_t t7,
+                                         uint8_t t8, uint8_t t9, uint8_t t10, uint8_t t11,
+                                         uint8_t t12, uint8_t t13, uint8_t t14, uint8_t t15) {
+        return _mm256_setr_epi8(
+            t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15,
+            t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15);
     }
     
-    /**
-     * @brief Check if a tool exists
-     */
-    bool hasTool(const std::string& name) const {
-        return tools_.find(name) != tools_.end();
+    MCP_TARGET_AVX2 static __m256i high_nibble(__m256i v) {
+        return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0F));
     }
     
     /**
-     * @brief Get all registered tools
+     * @brief The input shifted right by N bytes across the block boundary
      */
-    const std::unordered_map<std::string, std::shared_ptr<Tool>>& getAllTools() const {
-        return tools_;
+    template<int N>
+    MCP_TARGET_AVX2 static __m256i prev(__m256i input, __m256i prev_input) {
+        return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev_input, input, 0x21), 16 - N);
     }
     
-    /**
-     * @brief Get the JSON array of all tool schemas for tools/list
-     */
-    json getToolsList() const {
-        json tools_array = json::array();
-        for (const auto& [name, tool] : tools_) {
-            tools_array.push_back(tool->getSchema());
+    MCP_TARGET_AVX2 static void check_block(__m256i input, __m256i& prev_input,
+                                            __m256i& prev_incomplete, __m256i& error) {
+        if (_mm256_movemask_epi8(input) == 0) {
+            // All ASCII: only a sequence left open by the previous block can be wrong
+            error = _mm256_or_si256(error, prev_incomplete);
+            prev_input = input;
+            prev_incomplete = _mm256_setzero_si256();
+            return;
         }
-        return tools_array;
+        
+        __m256i prev1 = prev<1>(input, prev_input);
+        
+        __m256i byte_1_high = _mm256_shuffle_epi8(table(
+            // 0_______ ________ <ASCII in byte 1>
+            TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+            TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+            // 10______ ________ <continuation in byte 1>
+            TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+            // 1100____ ________ <two byte lead in byte 1>
+            TOO_SHORT | OVERLONG_2,
+            // 1101____ ________ <two byte lead in byte 1>
+            TOO_SHORT,
+            // 1110____ ________ <three byte lead in byte 1>
+            TOO_SHORT | OVERLONG_3 | SURROGATE,
+            // 1111____ ________ <four+ byte lead in byte 1>
+            TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4), high_nibble(prev1));
+        
+        __m256i byte_1_low = _mm256_shuffle_epi8(table(
+            // ____0000 ________
+            CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+            // ____0001 ________
+            CARRY | OVERLONG_2,
+            // ____001_ ________
+            CARRY,
+            CARRY,
+            // ____0100 ________
+            CARRY | TOO_LARGE,
+            // ____0101 ________
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            // ____011_ ________
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            // ____1___ ________
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            // ____1101 ________
+            CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000), _mm256_and_si256(prev1, _mm256_set1_epi8(0x0F)));
+        
+        __m256i byte_2_high = _mm256_shuffle_epi8(table(
+            // ________ 0_______ <ASCII in byte 2>
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+            // ________ 1000____
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+            // ________ 1001____
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+            // ________ 101_____
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+            // ________ 11______
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT), high_nibble(input));
+        
+        __m256i special_cases = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+        
+        // Continuations required two/three bytes after a 3-/4-byte lead
+        __m256i prev2 = prev<2>(input, prev_input);
+        __m256i prev3 = prev<3>(input, prev_input);
+        __m256i is_third_byte = _mm256_subs_epu8(prev2, _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+        __m256i is_fourth_byte = _mm256_subs_epu8(prev3, _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+        __m256i must23_80 = _mm256_and_si256(_mm256_or_si256(is_third_byte, is_fourth_byte),
+                                             _mm256_set1_epi8(static_cast<char>(0x80)));
+        error = _mm256_or_si256(error, _mm256_xor_si256(must23_80, special_cases));
+        
+        // A lead byte in the last three positions needs bytes from the next block
+        const __m256i max_value = _mm256_setr_epi8(
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            static_cast<char>(0xF0 - 1), static_cast<char>(0xE0 - 1), static_cast<char>(0xC0 - 1));
+        prev_incomplete = _mm256_subs_epu8(input, max_value);
+        prev_input = input;
     }
-    
-private:
-    ToolRegistry() = default;
-    std::unordered_map<std::string, std::shared_ptr<Tool>> tools_;
 };
 
-// ============================================================================
-// Built-in Tools
-// ============================================================================
+#endif // MCP_SIMD_X86
 
 /**
- * @brief Echo tool - echoes back the input text
+ * @brief Kernels picked once for the running CPU
  */
-class EchoTool : public Tool {
-public:
-    std::string getName() const override {
-        return "echo";
-    }
-    
-    std::string getDescription() const override {
-        return "Echoes back the input text";
-    }
+struct TextKernels {
+    size_t (*escape_scan)(const char*, size_t);
+    bool (*utf8_valid)(const unsigned char*, size_t);
+    size_t (*url_special_scan)(const char*, size_t);
+    const char* name;
     
-    std::vector<ToolProperty> getProperties() const override {
-        return {
-            ToolProperty("text", "string", "Text to echo back", true)
-        };
+    static const TextKernels& get() {
+        static const TextKernels kernels = detect();
+        return kernels;
     }
     
-    json execute(const json& arguments) override {
-        std::string text = arguments.value("text", "");
-        return createTextContent("Echo: " + text);
+private:
+    static TextKernels detect() {
+#if defined(MCP_SIMD_X86)
+        if (__builtin_cpu_supports("avx2")) {
+            return {json_escape_scan_avx2,
+                    [](const unsigned char* p, size_t n) { return Utf8ValidatorAvx2::validate(p, n); },
+                    url_special_scan_avx2,
+                    "avx2"};
+        }
+        return {json_escape_scan_sse2,
+                [](const unsigned char* p, size_t n) { return utf8_valid_sse2(p, p + n); },
+                url_special_scan_sse2,
+                "sse2"};
+#else
+        return {json_escape_scan_scalar,
+                [](const unsigned char* p, size_t n) { return utf8_valid_scalar(p, p + n); },
+                url_special_scan_scalar,
+                "scalar"};
+#endif
     }
 };
 
-// ============================================================================
-// MCP Session and Server
-// ============================================================================
+/**
+ * @brief Index of the first byte in [data, data + length) that must be escaped, or length
+ */
+inline size_t json_escape_scan(const char* data, size_t length) {
+    return TextKernels::get().escape_scan(data, length);
+}
 
-class MCPSession : public std::enable_shared_from_this<MCPSession> {
-public:
-    MCPSession(tcp::socket socket) : socket_(std::move(socket)) {}
+/**
+ * @brief Check that text is well-formed UTF-8 (no overlongs, surrogates or values past U+10FFFF)
+ */
+inline bool utf8_valid(std::string_view text) {
+    return TextKernels::get().utf8_valid(reinterpret_cast<const unsigned char*>(text.data()), text.size());
+}
 
-    void start() {
-        read_request();
+/**
+ * @brief Standard base64 with padding, for binary data sent as JSON
+ */
+inline std::string base64_encode(const uint8_t* data, size_t length) {
+    static const char* const kAlphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.reserve((length + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 3 <= length; i += 3) {
+        uint32_t v = uint32_t(data[i]) << 16 | uint32_t(data[i + 1]) << 8 | data[i + 2];
+        out += kAlphabet[v >> 18];
+        out += kAlphabet[(v >> 12) & 63];
+        out += kAlphabet[(v >> 6) & 63];
+        out += kAlphabet[v & 63];
     }
+    if (i < length) {
+        uint32_t v = uint32_t(data[i]) << 16 | (i + 1 < length ? uint32_t(data[i + 1]) << 8 : 0);
+        out += kAlphabet[v >> 18];
+        out += kAlphabet[(v >> 12) & 63];
+        out += i + 1 < length ? kAlphabet[(v >> 6) & 63] : '=';
+        out += '=';
+    }
+    return out;
+}
 
-private:
-    void read_request() {
-        auto self(shared_from_this());
-        asio::async_read_until(socket_, buffer_, "\r\n\r\n",
-            [this, self](std::error_code ec, std::size_t) {
-                if (!ec) {
-                    std::istream is(&buffer_);
-                    std::string request_line;
-                    std::getline(is, request_line);
-                    
-                    // Parse HTTP method and path
-                    std::istringstream iss(request_line);
-                    std::string method, path, version;
-                    iss >> method >> path >> version;
-                    
-                    std::cout << "Request: " << method << " " << path << std::endl;
-                    
-                    // Read headers
-                    std::unordered_map<std::string, std::string> headers;
-                    std::string line;
-                    while (std::getline(is, line) && line != "\r") {
-                        auto colon_pos = line.find(':');
-                        if (colon_pos != std::string::npos) {
-                            std::string key = line.substr(0, colon_pos);
-                            std::string value = line.substr(colon_pos + 2);
-                            if (!value.empty() && value.back() == '\r') {
-                                value.pop_back();
-                            }
-                            // Convert key to lowercase for case-insensitive lookup
-                            std::transform(key.begin(), key.end(), key.begin(), ::tolower);
-                            headers[key] = value;
-                        }
-                    }
-                    
-                    std::cout << "Headers received:" << std::endl;
-                    for (const auto& h : headers) {
-                        std::cout << "  " << h.first << ": " << h.second << std::endl;
-                    }
-                    
-                    if (method == "POST") {
-                        if (path == "/" || path == "/message") {
-                            read_post_body(headers);
-                        } else {
-                            send_404();
-                        }
-                    } else if (method == "GET") {
-                        handle_get_request(path, headers);
-                    } else if (method == "OPTIONS") {
-                        send_cors_response();
-                    } else {
-                        send_404();
-                    }
-                } else {
-                    std::cerr << "Error reading request: " << ec.message() << std::endl;
+/**
+ * @brief Move pos back to the start of the UTF-8 character it falls inside
+ * 
+ * Used to cut valid text into pieces that are valid on their own.
+ */
+inline size_t utf8_floor(std::string_view text, size_t pos) {
+    while (pos > 0 && pos < text.size() && (static_cast<unsigned char>(text[pos]) & 0xC0) == 0x80) {
+        pos--;
+    }
+    return pos;
+}
+
+/**
+ * @brief Write the inside of a JSON string literal, escaping as json::dump() does
+ * 
+ * Runs of bytes that need no escaping are copied in one go. Out needs
+ * write_character(), write_characters() and write_literal().
+ */
+template<typename Out>
+void write_json_escaped(Out& out, std::string_view text) {
+    static const char* const kHex = "0123456789abcdef";
+    
+    const char* p = text.data();
+    size_t left = text.size();
+    while (left > 0) {
+        size_t run = json_escape_scan(p, left);
+        out.write_characters(p, run);
+        p += run;
+        left -= run;
+        if (left == 0) {
+            break;
+        }
+        
+        unsigned char c = static_cast<unsigned char>(*p);
+        switch (c) {
+            case '"': out.write_literal("\\\""); break;
+            case '\\': out.write_literal("\\\\"); break;
+            case '\b': out.write_literal("\\b"); break;
+            case '\f': out.write_literal("\\f"); break;
+            case '\n': out.write_literal("\\n"); break;
+            case '\r': out.write_literal("\\r"); break;
+            case '\t': out.write_literal("\\t"); break;
+            default: {
+                char escape[6] = {'\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 0xF]};
+                out.write_characters(escape, sizeof(escape));
+                break;
+            }
+        }
+        ++p;
+        --left;
+    }
+}
+
+/**
+ * @brief Index of the first '%' or '+' in [data, data + length), or length
+ */
+inline size_t url_special_scan(const char* data, size_t length) {
+    return TextKernels::get().url_special_scan(data, length);
+}
+
+// ============================================================================
+// URL Decoding
+// ============================================================================
+
+/**
+ * @brief Hex digit values, -1 for anything else
+ */
+struct HexTable {
+    int8_t value[256];
+    
+    constexpr HexTable() : value() {
+        for (int i = 0; i < 256; ++i) {
+            value[i] = -1;
+        }
+        for (int i = 0; i < 10; ++i) {
+            value['0' + i] = static_cast<int8_t>(i);
+        }
+        for (int i = 0; i < 6; ++i) {
+            value['a' + i] = static_cast<int8_t>(10 + i);
+            value['A' + i] = static_cast<int8_t>(10 + i);
+        }
+    }
+};
+
+inline constexpr HexTable kHexTable{};
+
+/**
+ * @brief Decode %XX escapes and '+' in place
+ * 
+ * Bytes up to the first '%' or '+' never move; after that each run between
+ * escapes is moved down in one memmove. Malformed escapes are kept verbatim.
+ * @return Decoded length
+ */
+inline size_t url_decode_in_place(char* data, size_t length) {
+    size_t read = url_special_scan(data, length);
+    size_t write = read;
+    
+    while (read < length) {
+        char c = data[read];
+        if (c == '+') {
+            data[write++] = ' ';
+            ++read;
+        } else {
+            int hi = -1;
+            int lo = -1;
+            if (read + 2 < length) {
+                hi = kHexTable.value[static_cast<unsigned char>(data[read + 1])];
+                lo = kHexTable.value[static_cast<unsigned char>(data[read + 2])];
+            }
+            if (hi >= 0 && lo >= 0) {
+                data[write++] = static_cast<char>((hi << 4) | lo);
+                read += 3;
+            } else {
+                data[write++] = c;
+                ++read;
+            }
+        }
+        
+        size_t run = url_special_scan(data + read, length - read);
+        std::memmove(data + write, data + read, run);
+        read += run;
+        write += run;
+    }
+    return write;
+}
+
+std::string url_decode(const std::string& str) {
+    std::string result = str;
+    result.resize(url_decode_in_place(&result[0], result.size()));
+    return result;
+}
+
+/**
+ * @brief Parsed, decoded query string ("a=1&b=x%20y")
+ * 
+ * Decodes once into its own buffer; keys and values are views into it.
+ */
+class QueryString {
+public:
+    QueryString() = default;
+    
+    // Views point into buffer_, so copies would dangle
+    QueryString(const QueryString&) = delete;
+    QueryString& operator=(const QueryString&) = delete;
+    
+    /**
+     * @brief Replace the contents with a freshly decoded query string
+     */
+    void parse(std::string query) {
+        buffer_ = std::move(query);
+        params_.clear();
+        
+        char* data = &buffer_[0];
+        size_t length = buffer_.size();
+        size_t pos = 0;
+        
+        while (pos < length) {
+            char* amp = static_cast<char*>(std::memchr(data + pos, '&', length - pos));
+            size_t end = amp ? static_cast<size_t>(amp - data) : length;
+            
+            if (end > pos) {
+                char* eq = static_cast<char*>(std::memchr(data + pos, '=', end - pos));
+                size_t key_end = eq ? static_cast<size_t>(eq - data) : end;
+                size_t key_length = url_decode_in_place(data + pos, key_end - pos);
+                size_t value_length = 0;
+                if (eq) {
+                    value_length = url_decode_in_place(data + key_end + 1, end - key_end - 1);
+                }
+                params_.emplace_back(std::string_view(data + pos, key_length),
+                                     std::string_view(eq ? data + key_end + 1 : data + end, value_length));
+            }
+            pos = end + 1;
+        }
+    }
+    
+    /**
+     * @brief Value of the first parameter with this key ("" if absent)
+     */
+    std::string_view get(std::string_view key) const {
+        for (const auto& param : params_) {
+            if (param.first == key) {
+                return param.second;
+            }
+        }
+        return {};
+    }
+    
+    bool has(std::string_view key) const {
+        for (const auto& param : params_) {
+            if (param.first == key) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    const std::vector<std::pair<std::string_view, std::string_view>>& params() const { return params_; }
+    
+private:
+    std::string buffer_;
+    std::vector<std::pair<std::string_view, std::string_view>> params_;
+};
+
+// ============================================================================
+// Argument Completion
+// ============================================================================
+
+/**
+ * @brief Suggestions for one argument, best first
+ */
+struct Completion {
+    std::vector<std::string> values;
+    size_t total = 0;   // all matches, of which values holds the first few
+};
+
+/**
+ * @brief Supplies completion/complete suggestions for a tool argument
+ * 
+ * Called on the io thread while the user types, so implementations must
+ * answer in microseconds; PrefixIndex does.
+ */
+class CompletionProvider {
+public:
+    virtual ~CompletionProvider() = default;
+    
+    /**
+     * @brief Up to limit values starting with prefix
+     */
+    virtual Completion complete(std::string_view prefix, size_t limit) const = 0;
+};
+
+/**
+ * @brief Weighted string set answering top-k prefix queries
+ * 
+ * Values live in one sorted array: a single character buffer plus offsets,
+ * so a million short values cost little more than their text. A prefix
+ * is a contiguous range of that array, found by binary search. The top k
+ * by weight come out of a heap of subranges. The heaviest entry of a
+ * subrange spanning several 64-entry blocks is found in constant time,
+ * from in-block prefix and suffix maxima plus a sparse table over block
+ * maxima; shorter ones scan their block. A query therefore costs O(k)
+ * however many values match. Ties go to the lexicographically smaller value.
+ * 
+ * Updates do not touch the array. Inserted values go to a small sorted
+ * side array, and removed ones are marked in a bitmap and a Fenwick tree
+ * (which keeps match counts exact). Once kMaxPending updates have
+ * accumulated, everything is merged into a new array in one linear pass.
+ * The merge runs without the lock, from a copy of the pending updates;
+ * queries and updates carry on against the old array meanwhile, and the
+ * updates made during the merge are replayed onto the new one when it is
+ * swapped in.
+ * 
+ * Queries take a shared lock and updates an exclusive one, both only
+ * briefly, so providers can be fed from any thread.
+ * 
+ * @code
+ * auto symbols = std::make_shared<PrefixIndex>(load_symbol_names());
+ * symbols->insert("parse_http_method", 10);   // weight: ranks above weight 0
+ * Completion c = symbols->complete("parse_", 20);
+ * @endcode
+ */
+class PrefixIndex : public CompletionProvider {
+public:
+    static constexpr size_t kMaxPending = 4096;
+    
+    PrefixIndex() { reset(build({}, {0}, {})); }
+    
+    /**
+     * @brief Build the index from values, all with weight 0 (duplicates are dropped)
+     */
+    explicit PrefixIndex(std::vector<std::string> values) {
+        std::sort(values.begin(), values.end());
+        values.erase(std::unique(values.begin(), values.end()), values.end());
+        std::string chars;
+        std::vector<uint32_t> offsets{0};
+        for (const auto& value : values) {
+            chars += value;
+            offsets.push_back(uint32_t(chars.size()));
+            if (chars.size() > UINT32_MAX) {
+                throw std::length_error("PrefixIndex is limited to 4 GiB of values");
+            }
+        }
+        reset(build(std::move(chars), std::move(offsets), std::vector<uint32_t>(values.size(), 0)));
+    }
+    
+    /**
+     * @brief Add a value, or change the weight of one already present
+     */
+    void insert(std::string_view value, uint32_t weight = 0) {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        apply(Update{std::string(value), weight, false});
+        compact_if_needed(lock);
+    }
+    
+    /**
+     * @brief Remove a value if present
+     */
+    void erase(std::string_view value) {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        apply(Update{std::string(value), 0, true});
+        compact_if_needed(lock);
+    }
+    
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return live_;
+    }
+    
+    Completion complete(std::string_view prefix, size_t limit) const override {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        const Sorted& sorted = sorted_;
+        
+        // Matching range of the main array
+        size_t lo = sorted.partition_point(0, [&](size_t i) { return sorted.key(i) < prefix; });
+        size_t hi = sorted.partition_point(lo, [&](size_t i) {
+            return sorted.key(i).substr(0, prefix.size()) == prefix;
+        });
+        
+        struct Candidate {
+            std::string_view value;
+            uint32_t weight;
+        };
+        auto better = [](const Candidate& a, const Candidate& b) {
+            return a.weight != b.weight ? a.weight > b.weight : a.value < b.value;
+        };
+        std::vector<Candidate> candidates;
+        
+        // Heaviest entries of [lo, hi): pop a range's best, split the range around it
+        struct Range {
+            uint32_t lo, hi, best;
+        };
+        auto heavier = [&sorted](const Range& a, const Range& b) { return !sorted.prefer(a.best, b.best); };
+        std::priority_queue<Range, std::vector<Range>, decltype(heavier)> ranges(heavier);
+        if (lo < hi) {
+            ranges.push({uint32_t(lo), uint32_t(hi), sorted.best_in(lo, hi)});
+        }
+        while (!ranges.empty() && candidates.size() < limit) {
+            Range r = ranges.top();
+            ranges.pop();
+            if (!erased_[r.best]) {
+                candidates.push_back({sorted.key(r.best), sorted.weights[r.best]});
+            }
+            if (r.lo < r.best) {
+                ranges.push({r.lo, r.best, sorted.best_in(r.lo, r.best)});
+            }
+            if (r.best + 1 < r.hi) {
+                ranges.push({r.best + 1, r.hi, sorted.best_in(r.best + 1, r.hi)});
+            }
+        }
+        
+        size_t added = 0;
+        for (auto it = std::lower_bound(added_.begin(), added_.end(), prefix,
+                 [](const Entry& e, std::string_view v) { return e.value < v; });
+             it != added_.end() && std::string_view(it->value).substr(0, prefix.size()) == prefix; ++it) {
+            candidates.push_back({it->value, it->weight});
+            added++;
+        }
+        
+        size_t keep = std::min(limit, candidates.size());
+        std::partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end(), better);
+        
+        Completion completion;
+        completion.total = (hi - lo) - (erased_before(hi) - erased_before(lo)) + added;
+        for (size_t i = 0; i < keep; ++i) {
+            completion.values.emplace_back(candidates[i].value);
+        }
+        return completion;
+    }
+    
+private:
+    struct Entry {
+        std::string value;
+        uint32_t weight;
+    };
+    
+    struct Update {
+        std::string value;
+        uint32_t weight;
+        bool erase;
+    };
+    
+    static constexpr size_t kBlock = 64;
+    
+    /**
+     * @brief The sorted array and its range-maximum tables; never changed once built
+     */
+    struct Sorted {
+        std::string chars;
+        std::vector<uint32_t> offsets;
+        std::vector<uint32_t> weights;
+        std::vector<uint32_t> prefix_best;
+        std::vector<uint32_t> suffix_best;
+        std::vector<std::vector<uint32_t>> block_best;
+        
+        size_t size() const { return weights.size(); }
+        
+        std::string_view key(size_t i) const {
+            return std::string_view(chars).substr(offsets[i], offsets[i + 1] - offsets[i]);
+        }
+        
+        /**
+         * @brief First index from lo on where pred fails (pred must hold for a prefix of the array)
+         */
+        template<typename Pred>
+        size_t partition_point(size_t lo, Pred pred) const {
+            size_t hi = size();
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (pred(mid)) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            return lo;
+        }
+        
+        size_t find(std::string_view value) const {
+            size_t i = partition_point(0, [&](size_t j) { return key(j) < value; });
+            return i < size() && key(i) == value ? i : SIZE_MAX;
+        }
+        
+        // Heavier, or as heavy and earlier
+        bool prefer(size_t a, size_t b) const {
+            return weights[a] != weights[b] ? weights[a] > weights[b] : a < b;
+        }
+        
+        uint32_t best_in(size_t lo, size_t hi) const {
+            size_t best = lo;
+            size_t first_block = lo / kBlock;
+            size_t last_block = (hi - 1) / kBlock;
+            if (first_block == last_block) {
+                for (size_t i = lo + 1; i < hi; ++i) {
+                    best = prefer(i, best) ? i : best;
+                }
+                return uint32_t(best);
+            }
+            
+            best = suffix_best[lo];
+            size_t tail = prefix_best[hi - 1];
+            best = prefer(tail, best) ? tail : best;
+            if (first_block + 1 < last_block) {
+                // Whole blocks in between: two overlapping power-of-two spans
+                size_t a = first_block + 1;
+                size_t count = last_block - a;
+                size_t level = 0;
+                while ((size_t(2) << level) <= count) {
+                    level++;
+                }
+                size_t left = block_best[level][a];
+                size_t right = block_best[level][last_block - (size_t(1) << level)];
+                best = prefer(left, best) ? left : best;
+                best = prefer(right, best) ? right : best;
+            }
+            return uint32_t(best);
+        }
+    };
+    
+    /**
+     * @brief Apply one update to the pending state (exclusive lock held)
+     */
+    void apply(const Update& update) {
+        if (compacting_) {
+            replay_.push_back(update);
+        }
+        auto it = std::lower_bound(added_.begin(), added_.end(), update.value,
+            [](const Entry& e, const std::string& v) { return e.value < v; });
+        bool in_added = it != added_.end() && it->value == update.value;
+        
+        if (update.erase) {
+            if (in_added) {
+                added_.erase(it);
+                live_--;
+                return;
+            }
+            size_t i = sorted_.find(update.value);
+            if (i != SIZE_MAX && !erased_[i]) {
+                mark_erased(i);
+                live_--;
+            }
+            return;
+        }
+        
+        size_t i = sorted_.find(update.value);
+        if (i != SIZE_MAX && !erased_[i]) {
+            if (sorted_.weights[i] == update.weight) {
+                return;
+            }
+            mark_erased(i);
+            live_--;
+        }
+        if (in_added) {
+            it->weight = update.weight;
+        } else {
+            added_.insert(it, Entry{update.value, update.weight});
+            live_++;
+        }
+    }
+    
+    void mark_erased(size_t i) {
+        erased_[i] = true;
+        erased_count_++;
+        for (size_t j = i + 1; j < fenwick_.size(); j += j & (~j + 1)) {
+            fenwick_[j]++;
+        }
+    }
+    
+    // Erased entries among the first n
+    size_t erased_before(size_t n) const {
+        size_t count = 0;
+        for (size_t j = n; j > 0; j -= j & (~j + 1)) {
+            count += fenwick_[j];
+        }
+        return count;
+    }
+    
+    /**
+     * @brief Merge the pending updates into a new array once there are enough of them
+     * 
+     * Only one merge runs at a time. sorted_ is only replaced here, so the
+     * merge can read it after the lock is dropped; erased_ and added_ keep
+     * changing and are copied first. Returns with the lock released.
+     */
+    void compact_if_needed(std::unique_lock<std::shared_mutex>& lock) {
+        if (compacting_ || added_.size() + erased_count_ < kMaxPending) {
+            return;
+        }
+        compacting_ = true;
+        std::vector<bool> erased = erased_;
+        std::vector<Entry> added = added_;
+        size_t live = live_;
+        lock.unlock();
+        
+        Sorted merged;
+        try {
+            merged = merge(erased, added, live);
+        } catch (...) {
+            lock.lock();
+            compacting_ = false;
+            replay_.clear();
+            throw;
+        }
+        
+        lock.lock();
+        Sorted retired = reset(std::move(merged));
+        compacting_ = false;
+        std::vector<Update> replay = std::move(replay_);
+        replay_.clear();
+        for (const auto& update : replay) {
+            apply(update);
+        }
+        lock.unlock();
+    }
+    
+    /**
+     * @brief sorted_ without the erased entries, with added merged in (no lock needed)
+     */
+    Sorted merge(const std::vector<bool>& erased, const std::vector<Entry>& added, size_t live) const {
+        std::string chars;
+        chars.reserve(sorted_.chars.size() + added.size() * 16);
+        std::vector<uint32_t> offsets{0};
+        offsets.reserve(live + 1);
+        std::vector<uint32_t> weights;
+        weights.reserve(live);
+        auto append = [&](std::string_view value, uint32_t weight) {
+            chars.append(value);
+            offsets.push_back(uint32_t(chars.size()));
+            weights.push_back(weight);
+        };
+        
+        auto add = added.begin();
+        for (size_t i = 0; i < sorted_.size(); ++i) {
+            if (erased[i]) {
+                continue;
+            }
+            std::string_view value = sorted_.key(i);
+            for (; add != added.end() && add->value < value; ++add) {
+                append(add->value, add->weight);
+            }
+            append(value, sorted_.weights[i]);
+        }
+        for (; add != added.end(); ++add) {
+            append(add->value, add->weight);
+        }
+        if (chars.size() > UINT32_MAX) {
+            throw std::length_error("PrefixIndex is limited to 4 GiB of values");
+        }
+        return build(std::move(chars), std::move(offsets), std::move(weights));
+    }
+    
+    static Sorted build(std::string chars, std::vector<uint32_t> offsets, std::vector<uint32_t> weights) {
+        Sorted sorted;
+        size_t n = weights.size();
+        sorted.chars = std::move(chars);
+        sorted.offsets = std::move(offsets);
+        sorted.weights = std::move(weights);
+        
+        // Best entry of each block prefix and suffix, then block_best[j][b]:
+        // best entry in blocks b .. b + 2^j - 1
+        size_t blocks = (n + kBlock - 1) / kBlock;
+        sorted.prefix_best.resize(n);
+        sorted.suffix_best.resize(n);
+        sorted.block_best.assign(1, std::vector<uint32_t>(blocks));
+        for (size_t b = 0; b < blocks; ++b) {
+            size_t first = b * kBlock;
+            size_t last = std::min(n, first + kBlock) - 1;
+            auto& prefix = sorted.prefix_best;
+            auto& suffix = sorted.suffix_best;
+            prefix[first] = uint32_t(first);
+            for (size_t i = first + 1; i <= last; ++i) {
+                prefix[i] = sorted.prefer(i, prefix[i - 1]) ? uint32_t(i) : prefix[i - 1];
+            }
+            suffix[last] = uint32_t(last);
+            for (size_t i = last; i-- > first;) {
+                suffix[i] = sorted.prefer(i, suffix[i + 1]) ? uint32_t(i) : suffix[i + 1];
+            }
+            sorted.block_best[0][b] = prefix[last];
+        }
+        for (size_t level = 1; (size_t(1) << level) <= blocks; ++level) {
+            const auto& below = sorted.block_best[level - 1];
+            std::vector<uint32_t> row(blocks - (size_t(1) << level) + 1);
+            for (size_t b = 0; b < row.size(); ++b) {
+                uint32_t a = below[b];
+                uint32_t c = below[b + (size_t(1) << (level - 1))];
+                row[b] = sorted.prefer(a, c) ? a : c;
+            }
+            sorted.block_best.push_back(std::move(row));
+        }
+        return sorted;
+    }
+    
+    /**
+     * @brief Make sorted the main array with nothing pending; returns the old one
+     */
+    Sorted reset(Sorted sorted) {
+        size_t n = sorted.size();
+        std::swap(sorted_, sorted);
+        erased_.assign(n, false);
+        fenwick_.assign(n + 1, 0);
+        erased_count_ = 0;
+        added_.clear();
+        live_ = n;
+        return sorted;
+    }
+    
+    mutable std::shared_mutex mutex_;
+    Sorted sorted_;
+    std::vector<bool> erased_;
+    std::vector<uint32_t> fenwick_;
+    size_t erased_count_ = 0;
+    std::vector<Entry> added_;      // sorted, none of them live in the main array
+    size_t live_ = 0;
+    bool compacting_ = false;
+    std::vector<Update> replay_;    // updates made while a merge runs
+};
+
+// ============================================================================
+// Session Logging
+// ============================================================================
+
+/**
+ * @brief Severity of a log record, as in RFC 5424 and MCP's logging/setLevel
+ */
+enum class LogLevel { Debug, Info, Notice, Warning, Error, Critical, Alert, Emergency, Off };
+
+inline const char* log_level_name(LogLevel level) {
+    static const char* const kNames[] = {
+        "debug", "info", "notice", "warning", "error", "critical", "alert", "emergency", "off"
+    };
+    return kNames[static_cast<int>(level)];
+}
+
+/**
+ * @brief Parse a level name; "off" is not a level a client can ask for
+ */
+inline bool parse_log_level(std::string_view name, LogLevel& level) {
+    for (int i = 0; i < static_cast<int>(LogLevel::Off); ++i) {
+        if (name == log_level_name(static_cast<LogLevel>(i))) {
+            level = static_cast<LogLevel>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Log records one session asked for with logging/setLevel
+ * 
+ * A record below the session's level is turned away by one relaxed atomic
+ * load, before its message is formatted. Records that pass the level then
+ * need a token from the session's bucket (rate per second, up to burst at
+ * once); without one they are counted as dropped, also unformatted. The
+ * next record to get through is preceded by a warning saying how many
+ * were dropped. Accepted records go to the deliver function as
+ * notifications/message. Safe to use from any thread.
+ */
+class SessionLog {
+public:
+    using Deliver = std::function<void(json)>;
+    
+    SessionLog(double rate, double burst, Deliver deliver)
+        : rate_(rate), burst_(std::max(burst, 1.0)), tokens_(burst_), refilled_(Clock::now()),
+          deliver_(std::move(deliver)) {}
+    
+    void setLevel(LogLevel level) { level_.store(level, std::memory_order_relaxed); }
+    LogLevel level() const { return level_.load(std::memory_order_relaxed); }
+    
+    /**
+     * @brief Whether a record at this level would be sent, rate limit aside
+     */
+    bool enabled(LogLevel level) const { return level >= level_.load(std::memory_order_relaxed); }
+    
+    /**
+     * @brief Send a record; format() builds its data and only runs if the record is sent
+     * @param format Returns the record's data (a string or any JSON value)
+     */
+    template<typename Format>
+    void log(LogLevel level, std::string_view logger, Format&& format) {
+        if (!enabled(level)) {
+            return;
+        }
+        uint64_t unreported = 0;
+        if (!admit(unreported)) {
+            return;
+        }
+        if (unreported > 0) {
+            emit(LogLevel::Warning, "mcp", std::to_string(unreported) + " log message(s) dropped by the rate limit");
+        }
+        emit(level, logger, json(format()));
+    }
+    
+    uint64_t sent() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return sent_;
+    }
+    
+    uint64_t dropped() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return dropped_;
+    }
+    
+private:
+    bool admit(uint64_t& unreported) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Clock::time_point now = Clock::now();
+        tokens_ = std::min(burst_, tokens_ + rate_ * std::chrono::duration<double>(now - refilled_).count());
+        refilled_ = now;
+        if (tokens_ < 1) {
+            dropped_++;
+            unreported_++;
+            return false;
+        }
+        tokens_ -= 1;
+        sent_++;
+        unreported = unreported_;
+        unreported_ = 0;
+        return true;
+    }
+    
+    void emit(LogLevel level, std::string_view logger, json data) {
+        deliver_({
+            {"jsonrpc", "2.0"},
+            {"method", "notifications/message"},
+            {"params", {
+                {"level", log_level_name(level)},
+                {"logger", logger},
+                {"data", std::move(data)}
+            }}
+        });
+    }
+    
+    std::atomic<LogLevel> level_{LogLevel::Off};
+    double rate_;
+    double burst_;
+    mutable std::mutex mutex_;
+    double tokens_;
+    Clock::time_point refilled_;
+    uint64_t sent_ = 0;
+    uint64_t dropped_ = 0;
+    uint64_t unreported_ = 0;
+    Deliver deliver_;
+};
+
+/**
+ * @brief The SessionLog of every session that enabled logging, by session ID
+ * 
+ * Tool calls for a session run on worker threads and may arrive on any
+ * shard, so this is looked up outside the shards, under a shared lock.
+ * The owning shard removes a session's entry when it reaps the session.
+ */
+class SessionLogs {
+public:
+    std::shared_ptr<SessionLog> find(const std::string& session_id) const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        auto it = logs_.find(session_id);
+        return it == logs_.end() ? nullptr : it->second;
+    }
+    
+    /**
+     * @brief The session's log, created with make() if it has none yet
+     */
+    template<typename Make>
+    std::shared_ptr<SessionLog> attach(const std::string& session_id, Make&& make) {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        auto& log = logs_[session_id];
+        if (!log) {
+            log = make();
+        }
+        return log;
+    }
+    
+    void erase(const std::string& session_id) {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        logs_.erase(session_id);
+    }
+    
+private:
+    mutable std::shared_mutex mutex_;
+    std::unordered_map<std::string, std::shared_ptr<SessionLog>> logs_;
+};
+
+// ============================================================================
+// Session State
+// ============================================================================
+
+/**
+ * @brief State tools keep for one session, one object per type
+ * 
+ * A tool asks for its own type with get<T>() and gets the same object on
+ * every call of that session, e.g. open file handles or query cursors.
+ * Each type gets a small index the first time any session uses it, so a
+ * lookup is two acquire loads (the slot's chunk, then the slot) rather than
+ * a hash of the type, and takes no lock once the object exists. Creation
+ * runs the factory without the lock, so a factory may ask for other types;
+ * if two calls race, the first object stored wins and the other is
+ * dropped. Calls of one session may run in parallel, so the objects
+ * themselves must be safe to share. Objects live until the session's
+ * state is dropped and are destroyed in reverse order of creation.
+ */
+class SessionState {
+public:
+    SessionState() = default;
+    SessionState(const SessionState&) = delete;
+    SessionState& operator=(const SessionState&) = delete;
+    
+    ~SessionState() {
+        for (auto it = order_.rbegin(); it != order_.rend(); ++it) {
+            Chunk* chunk = chunks_[*it / kChunkSlots].load(std::memory_order_relaxed);
+            size_t i = *it % kChunkSlots;
+            chunk->destroy[i](chunk->objects[i].load(std::memory_order_relaxed));
+        }
+        for (auto& chunk : chunks_) {
+            delete chunk.load(std::memory_order_relaxed);
+        }
+    }
+    
+    /**
+     * @brief The session's T, default-constructed on first use
+     */
+    template<typename T>
+    T& get() {
+        return get<T>([] { return std::make_unique<T>(); });
+    }
+    
+    /**
+     * @brief The session's T, created by make() (returning a unique_ptr<T>) on first use
+     */
+    template<typename T, typename Make>
+    T& get(Make&& make) {
+        size_t index = slot_index<T>();
+        if (T* existing = find<T>()) {
+            return *existing;
+        }
+        
+        // Declared before the lock, so a losing object is destroyed after it is released
+        std::unique_ptr<T> object = make();
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& slot = chunks_[index / kChunkSlots];
+        Chunk* chunk = slot.load(std::memory_order_relaxed);
+        if (!chunk) {
+            chunk = new Chunk();
+            slot.store(chunk, std::memory_order_release);
+        }
+        size_t i = index % kChunkSlots;
+        if (void* winner = chunk->objects[i].load(std::memory_order_relaxed)) {
+            return *static_cast<T*>(winner);
+        }
+        chunk->destroy[i] = [](void* p) { delete static_cast<T*>(p); };
+        order_.push_back(static_cast<uint32_t>(index));
+        chunk->objects[i].store(object.get(), std::memory_order_release);
+        return *object.release();
+    }
+    
+    /**
+     * @brief The session's T, or nullptr if no call created one yet
+     */
+    template<typename T>
+    T* find() const {
+        size_t index = slot_index<T>();
+        Chunk* chunk = chunks_[index / kChunkSlots].load(std::memory_order_acquire);
+        if (!chunk) {
+            return nullptr;
+        }
+        return static_cast<T*>(chunk->objects[index % kChunkSlots].load(std::memory_order_acquire));
+    }
+    
+private:
+    static constexpr size_t kChunkSlots = 64;
+    static constexpr size_t kMaxChunks = 64;
+    
+    // Slots are allocated a chunk at a time and never move, so readers need no lock
+    struct Chunk {
+        std::array<std::atomic<void*>, kChunkSlots> objects{};
+        std::array<void (*)(void*), kChunkSlots> destroy{};
+    };
+    
+    template<typename T>
+    static size_t slot_index() {
+        static const size_t index = [] {
+            size_t i = next_index_.fetch_add(1, std::memory_order_relaxed);
+            if (i >= kChunkSlots * kMaxChunks) {
+                throw std::length_error("Too many SessionState types");
+            }
+            return i;
+        }();
+        return index;
+    }
+    
+    static inline std::atomic<size_t> next_index_{0};
+    
+    std::array<std::atomic<Chunk*>, kMaxChunks> chunks_{};
+    std::mutex mutex_;                  // creation only
+    std::vector<uint32_t> order_;
+};
+
+/**
+ * @brief The SessionState of every live session, by session ID
+ * 
+ * Same arrangement as SessionLogs: entries are added by the owning shard
+ * when a session registers and looked up by tool workers under a shared
+ * lock. The owner's reaper erases the entry with the session; calls still
+ * running hold a reference, so the state is freed when the last of them
+ * returns.
+ */
+class SessionStates {
+public:
+    std::shared_ptr<SessionState> find(const std::string& session_id) const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        auto it = states_.find(session_id);
+        return it == states_.end() ? nullptr : it->second;
+    }
+    
+    void attach(const std::string& session_id) {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        auto& state = states_[session_id];
+        if (!state) {
+            state = std::make_shared<SessionState>();
+        }
+    }
+    
+    void erase(const std::string& session_id) {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        states_.erase(session_id);
+    }
+    
+private:
+    mutable std::shared_mutex mutex_;
+    std::unordered_map<std::string, std::shared_ptr<SessionState>> states_;
+};
+
+// ============================================================================
+// Tool System
+// ============================================================================
+
+class ToolExecutor;
+
+/**
+ * @brief Shared flag telling work that its result is no longer wanted
+ * 
+ * Copies share the same flag. A default-constructed token is never cancelled
+ * and costs nothing; use create() for one that can be.
+ */
+class CancellationToken {
+public:
+    CancellationToken() = default;
+    
+    static CancellationToken create() {
+        CancellationToken token;
+        token.state_ = std::make_shared<std::atomic<bool>>(false);
+        return token;
+    }
+    
+    void cancel() const {
+        if (state_) {
+            state_->store(true, std::memory_order_release);
+        }
+    }
+    
+    bool cancelled() const {
+        return state_ && state_->load(std::memory_order_acquire);
+    }
+    
+private:
+    std::shared_ptr<std::atomic<bool>> state_;
+};
+
+/**
+ * @brief Per-call context handed to Tool::execute
+ * 
+ * Carries the request deadline and a cancellation token (set when the client
+ * disconnects) so long-running tools can cut their work short once nobody is
+ * waiting for it, and the executor the call runs on so tools can fan out
+ * with a TaskGroup. It also names the calling session, gives access to that
+ * session's SessionState, and has a scratch arena for the call.
+ */
+class ToolContext {
+public:
+    explicit ToolContext(Clock::time_point deadline = Clock::time_point::max(), ToolExecutor* executor = nullptr,
+                         CancellationToken cancellation = CancellationToken())
+        : deadline_(deadline), executor_(executor), cancellation_(std::move(cancellation)) {}
+    
+    /**
+     * @brief Absolute deadline of the request (time_point::max() if none)
+     */
+    Clock::time_point deadline() const { return deadline_; }
+    
+    /**
+     * @brief Check if the request carries a deadline at all
+     */
+    bool hasDeadline() const { return deadline_ != Clock::time_point::max(); }
+    
+    /**
+     * @brief Check if the deadline has already passed
+     */
+    bool expired() const { return hasDeadline() && Clock::now() >= deadline_; }
+    
+    /**
+     * @brief Time left until the deadline, clamped at zero
+     */
+    std::chrono::milliseconds remaining() const {
+        if (!hasDeadline()) {
+            return std::chrono::milliseconds::max();
+        }
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline_ - Clock::now());
+        return std::max(left, std::chrono::milliseconds(0));
+    }
+    
+    /**
+     * @brief Check if the client went away while the call was running
+     */
+    bool cancelled() const { return cancellation_.cancelled(); }
+    
+    /**
+     * @brief True once the result can no longer reach anyone (cancelled or expired)
+     */
+    bool shouldStop() const { return cancelled() || expired(); }
+    
+    const CancellationToken& cancellation() const { return cancellation_; }
+    
+    /**
+     * @brief Executor running this call (nullptr when called outside the pool)
+     */
+    ToolExecutor* executor() const { return executor_; }
+    
+    /**
+     * @brief Tie the call to a session; the ID must outlive the call
+     */
+    void setSession(std::string_view session_id, std::shared_ptr<SessionState> state) {
+        session_id_ = session_id;
+        state_ = std::move(state);
+    }
+    
+    /**
+     * @brief ID of the calling session (empty if the call has none)
+     */
+    std::string_view sessionId() const { return session_id_; }
+    
+    /**
+     * @brief Whether state<T>() is available for this call
+     */
+    bool hasSession() const { return state_ != nullptr; }
+    
+    /**
+     * @brief The calling session's T, created on first use
+     * 
+     * Throws if the call has no session (for example a POST without a
+     * sessionId); check hasSession() to fall back instead.
+     */
+    template<typename T>
+    T& state() const {
+        if (!state_) {
+            throw std::logic_error("Tool call has no session state");
+        }
+        return state_->get<T>();
+    }
+    
+    /**
+     * @brief Scratch memory released in one go when the call returns
+     * 
+     * For short-lived containers built during the call, e.g.
+     * std::pmr::vector<std::string_view> parts(&context.arena()).
+     * The first kArenaInlineBytes come from the context itself (on the
+     * caller's stack), so small calls allocate nothing; nothing allocated
+     * here may be kept after execute() returns.
+     */
+    std::pmr::memory_resource& arena() { return arena_; }
+    
+    /**
+     * @brief Send log records of this call to the session's client
+     */
+    void setLog(std::shared_ptr<SessionLog> log, std::string logger) {
+        log_ = std::move(log);
+        logger_ = std::move(logger);
+    }
+    
+    /**
+     * @brief Whether the client wants records at this level
+     */
+    bool logEnabled(LogLevel level) const { return log_ && log_->enabled(level); }
+    
+    /**
+     * @brief Log to the client as notifications/message, if it enabled logging
+     * 
+     * format() builds the message and is only called if the record is sent:
+     * @code
+     * context.log(LogLevel::Debug, [&] { return "scanned " + std::to_string(n) + " files"; });
+     * @endcode
+     */
+    template<typename Format>
+    void log(LogLevel level, Format&& format) const {
+        if (log_) {
+            log_->log(level, logger_, std::forward<Format>(format));
+        }
+    }
+    
+    static constexpr size_t kArenaInlineBytes = 1024;
+    
+private:
+    Clock::time_point deadline_;
+    ToolExecutor* executor_;
+    CancellationToken cancellation_;
+    std::string_view session_id_;
+    std::shared_ptr<SessionState> state_;
+    std::shared_ptr<SessionLog> log_;
+    std::string logger_;
+    alignas(std::max_align_t) std::byte arena_inline_[kArenaInlineBytes];
+    std::pmr::monotonic_buffer_resource arena_{arena_inline_, sizeof(arena_inline_)};
+};
+
+/**
+ * @brief Read-only memory mapping of a file
+ * 
+ * Hand one to ToolResultWriter::addText() to send a file's contents without
+ * reading it into memory first. Falls back to reading the file on platforms
+ * without mmap.
+ */
+class MappedFile {
+public:
+    /**
+     * @brief Map a whole file
+     * @throws std::runtime_error if the file cannot be opened or mapped
+     */
+    static std::shared_ptr<const MappedFile> open(const std::string& path) {
+        auto file = std::shared_ptr<MappedFile>(new MappedFile());
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open " + path + ": " + std::strerror(errno));
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Cannot stat " + path + ": " + std::strerror(errno));
+        }
+        file->size_ = static_cast<size_t>(info.st_size);
+        if (file->size_ > 0) {
+            void* data = mmap(nullptr, file->size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Cannot map " + path + ": " + std::strerror(errno));
+            }
+            file->data_ = static_cast<const char*>(data);
+        }
+        ::close(fd);
+#else
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+        file->fallback_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        file->data_ = file->fallback_.data();
+        file->size_ = file->fallback_.size();
+#endif
+        return file;
+    }
+    
+    ~MappedFile() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (data_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+#endif
+    }
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    std::string_view view() const { return std::string_view(data_ ? data_ : "", size_); }
+    
+private:
+    MappedFile() = default;
+    
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+#if !(defined(__unix__) || defined(__APPLE__))
+    std::string fallback_;
+#endif
+};
+
+/**
+ * @brief Text content produced piece by piece, spooled to a temporary file once large
+ * 
+ * Pieces are escaped for JSON as they arrive. The first kSpillThreshold
+ * escaped bytes stay in memory; past that everything goes to an unlinked
+ * temporary file, which the response later streams with sendfile(). Memory
+ * use stays bounded by the threshold however much text a tool produces.
+ * 
+ * @code
+ * SpooledText& text = result.addSpooledText();
+ * while (std::getline(input, line)) {
+ *     text.append(line);
+ *     text.append("\n");
+ * }
+ * @endcode
+ */
+class SpooledText {
+public:
+    static constexpr size_t kSpillThreshold = 1 << 20;
+    // Unescaped bytes between the offsets remembered for readText()
+    static constexpr size_t kCheckpointInterval = 64 << 10;
+    
+    SpooledText() = default;
+    
+    ~SpooledText() {
+        if (file_) {
+            std::fclose(file_);
+        }
+    }
+    
+    SpooledText(const SpooledText&) = delete;
+    SpooledText& operator=(const SpooledText&) = delete;
+    
+    /**
+     * @brief Append a piece of text
+     * 
+     * Each piece must be valid UTF-8 by itself, so split text on character
+     * boundaries.
+     * @throws std::invalid_argument if the piece is not valid UTF-8
+     * @throws std::runtime_error if the temporary file cannot be written
+     */
+    void append(std::string_view piece) {
+        if (!utf8_valid(piece)) {
+            throw std::invalid_argument("Tool result text is not valid UTF-8");
+        }
+        while (!piece.empty()) {
+            if (text_size_ >= next_checkpoint_) {
+                checkpoints_.push_back({text_size_, size_});
+                next_checkpoint_ = text_size_ + kCheckpointInterval;
+            }
+            size_t n = utf8_floor(piece, static_cast<size_t>(std::min<uint64_t>(piece.size(), next_checkpoint_ - text_size_)));
+            if (n == 0) {
+                // A character straddles the checkpoint; take it whole
+                n = 1;
+                while (n < piece.size() && (static_cast<unsigned char>(piece[n]) & 0xC0) == 0x80) {
+                    n++;
+                }
+            }
+            write_json_escaped(*this, piece.substr(0, n));
+            text_size_ += n;
+            piece.remove_prefix(n);
+        }
+    }
+    
+    /**
+     * @brief Whether the text went to a temporary file
+     */
+    bool spilled() const { return file_ != nullptr; }
+    
+    /**
+     * @brief The escaped text, while it is still in memory
+     */
+    std::string_view memory() const { return memory_; }
+    
+    /**
+     * @brief Length of the escaped text
+     */
+    size_t size() const { return size_; }
+    
+    /**
+     * @brief Length of the text as appended (before escaping)
+     */
+    uint64_t textSize() const { return text_size_; }
+    
+    /**
+     * @brief Descriptor of the temporary file, with everything appended so far flushed to it
+     */
+    int fd() const {
+        std::fflush(file_);
+        return fileno(file_);
+    }
+    
+    /**
+     * @brief Copy escaped bytes out of memory or the temporary file
+     * @return Bytes read (less than length only at the end)
+     */
+    size_t read(uint64_t offset, char* data, size_t length) const {
+        if (!file_) {
+            size_t n = offset < memory_.size() ? std::min<size_t>(length, memory_.size() - offset) : 0;
+            std::memcpy(data, memory_.data() + offset, n);
+            return n;
+        }
+        std::fflush(file_);
+#if defined(__unix__) || defined(__APPLE__)
+        ssize_t n = ::pread(fileno(file_), data, length, static_cast<off_t>(offset));
+        return n > 0 ? static_cast<size_t>(n) : 0;
+#else
+        std::fseek(file_, static_cast<long>(offset), SEEK_SET);
+        size_t n = std::fread(data, 1, length, file_);
+        std::fseek(file_, 0, SEEK_END);
+        return n;
+#endif
+    }
+    
+    /**
+     * @brief Part of the text as appended, by unescaped offset and length
+     * 
+     * Decodes forward from the nearest checkpoint, so the cost depends on
+     * the length asked for, not on the offset.
+     */
+    std::string readText(uint64_t offset, size_t length) const {
+        uint64_t text_pos = 0;
+        uint64_t escaped_pos = 0;
+        auto checkpoint = std::upper_bound(checkpoints_.begin(), checkpoints_.end(), offset,
+            [](uint64_t value, const Checkpoint& c) { return value < c.text; });
+        if (checkpoint != checkpoints_.begin()) {
+            --checkpoint;
+            text_pos = checkpoint->text;
+            escaped_pos = checkpoint->escaped;
+        }
+        
+        auto hex = [](char c) { return c <= '9' ? c - '0' : c - 'a' + 10; };
+        std::string text;
+        std::string window;
+        size_t pos = 0;
+        uint64_t end = offset + length;
+        while (text_pos < end) {
+            // Refill so an escape sequence (at most 6 bytes) is never split
+            if (window.size() - pos < 6 && escaped_pos < size_) {
+                window.erase(0, pos);
+                pos = 0;
+                size_t kept = window.size();
+                window.resize(kept + std::min<uint64_t>(kReadBlock, size_ - escaped_pos));
+                size_t n = read(escaped_pos, &window[kept], window.size() - kept);
+                window.resize(kept + n);
+                escaped_pos += n;
+            }
+            if (pos >= window.size()) {
+                break;
+            }
+            
+            char c = window[pos++];
+            if (c == '\\' && pos < window.size()) {
+                char e = window[pos++];
+                switch (e) {
+                    case 'b': c = '\b'; break;
+                    case 'f': c = '\f'; break;
+                    case 'n': c = '\n'; break;
+                    case 'r': c = '\r'; break;
+                    case 't': c = '\t'; break;
+                    case 'u': c = static_cast<char>(hex(window[pos + 2]) << 4 | hex(window[pos + 3])); pos += 4; break;
+                    default: c = e; break;
+                }
+            }
+            if (text_pos >= offset) {
+                text.push_back(c);
+            }
+            text_pos++;
+        }
+        return text;
+    }
+    
+    // Output side of write_json_escaped()
+    void write_character(char c) {
+        write_characters(&c, 1);
+    }
+    
+    void write_characters(const char* data, size_t length) {
+        if (!file_ && memory_.size() + length > kSpillThreshold) {
+            file_ = std::tmpfile();
+            if (!file_) {
+                throw std::runtime_error(std::string("Cannot create a temporary file: ") + std::strerror(errno));
+            }
+            spill(memory_.data(), memory_.size());
+            std::string().swap(memory_);
+        }
+        if (file_) {
+            spill(data, length);
+        } else {
+            memory_.append(data, length);
+        }
+        size_ += length;
+    }
+    
+    template<size_t N>
+    void write_literal(const char (&text)[N]) {
+        write_characters(text, N - 1);
+    }
+    
+private:
+    void spill(const char* data, size_t length) {
+        if (std::fwrite(data, 1, length, file_) != length) {
+            throw std::runtime_error(std::string("Cannot write a temporary file: ") + std::strerror(errno));
+        }
+    }
+    
+    struct Checkpoint {
+        uint64_t text;
+        uint64_t escaped;
+    };
+    
+    static constexpr size_t kReadBlock = 64 << 10;
+    
+    std::string memory_;
+    std::FILE* file_ = nullptr;
+    size_t size_ = 0;
+    uint64_t text_size_ = 0;
+    uint64_t next_checkpoint_ = kCheckpointInterval;
+    std::vector<Checkpoint> checkpoints_;
+};
+
+/**
+ * @brief A byte range of spooled text, sent without passing through user space
+ */
+struct FileRegion {
+    std::shared_ptr<const SpooledText> text;
+    uint64_t offset = 0;
+    size_t length = 0;
+};
+
+class ChunkedJsonWriter;
+
+/**
+ * @brief Whether a value holds binary data anywhere
+ */
+inline bool contains_binary(const json& value) {
+    if (value.is_binary()) {
+        return true;
+    }
+    if (value.is_structured()) {
+        for (const auto& element : value) {
+            if (contains_binary(element)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Copy of a value with binary data replaced by base64 strings, as JSON carries it
+ */
+inline json binary_as_base64(const json& value) {
+    if (value.is_binary()) {
+        return base64_encode(value.get_binary().data(), value.get_binary().size());
+    }
+    if (value.is_object()) {
+        json copy = json::object();
+        for (auto it = value.begin(); it != value.end(); ++it) {
+            copy[it.key()] = binary_as_base64(it.value());
+        }
+        return copy;
+    }
+    if (value.is_array()) {
+        json copy = json::array();
+        for (const auto& element : value) {
+            copy.push_back(binary_as_base64(element));
+        }
+        return copy;
+    }
+    return value;
+}
+
+/**
+ * @brief Builds a tools/call result that is serialized straight into the response
+ * 
+ * Text handed to the writer is never copied into a json tree: it is escaped
+ * directly into the outbound buffers when the response is written. Owned
+ * strings are moved in, and string views, shared immutable buffers and
+ * mapped files are referenced in place. Text too large to hold in memory
+ * can be produced incrementally through addSpooledText().
+ * 
+ * @code
+ * void execute(const json& arguments, ToolContext& context, ToolResultWriter& result) override {
+ *     result.addText(MappedFile::open(arguments.value("path", "")));
+ * }
+ * @endcode
+ */
+class ToolResultWriter {
+public:
+    /**
+     * @brief Add a text content item, taking ownership of the string
+     */
+    void addText(std::string text) {
+        auto owned = std::make_shared<const std::string>(std::move(text));
+        addText(std::string_view(*owned), owned);
+    }
+    
+    /**
+     * @brief Add a text content item, copying a string literal or other C string
+     */
+    void addText(const char* text) {
+        addText(std::string(text));
+    }
+    
+    /**
+     * @brief Add a text content item that stays in a shared immutable buffer
+     */
+    void addText(std::shared_ptr<const std::string> text) {
+        addText(std::string_view(*text), text);
+    }
+    
+    /**
+     * @brief Add a text content item from a mapped file (or part of one)
+     */
+    void addText(std::shared_ptr<const MappedFile> file, size_t offset = 0, size_t length = std::string_view::npos) {
+        addText(file->view().substr(offset, length), file);
+    }
+    
+    /**
+     * @brief Add a text content item that refers to memory owned elsewhere
+     * 
+     * Nothing is copied. The memory must stay valid until the response has
+     * been written; keep_alive (if given) is held until then.
+     * @throws std::invalid_argument if the text is not valid UTF-8
+     */
+    void addText(std::string_view text, std::shared_ptr<const void> keep_alive = nullptr) {
+        if (!utf8_valid(text)) {
+            throw std::invalid_argument("Tool result text is not valid UTF-8");
+        }
+        Item item;
+        item.text = text;
+        item.keep_alive = std::move(keep_alive);
+        items_.push_back(std::move(item));
+    }
+    
+    /**
+     * @brief Add a text content item that is filled in piece by piece
+     * 
+     * The returned text stays valid as long as this writer.
+     */
+    SpooledText& addSpooledText() {
+        Item item;
+        auto text = std::make_shared<SpooledText>();
+        item.spool = text;
+        items_.push_back(std::move(item));
+        return *text;
+    }
+    
+    /**
+     * @brief Add any other content item (image, resource, ...) as JSON
+     * 
+     * Binary values (json::binary) go to CBOR and MessagePack clients as
+     * byte strings and to JSON clients as base64 strings.
+     */
+    void addContent(json block) {
+        Item item;
+        item.binary = contains_binary(block);
+        item.block = std::move(block);
+        item.is_text = false;
+        items_.push_back(std::move(item));
+    }
+    
+    /**
+     * @brief Add an image or audio content item from raw bytes
+     * 
+     * The bytes are base64-encoded only if the client reads JSON.
+     * @param type "image" or "audio"
+     */
+    void addBinary(const std::string& type, const std::string& mime_type, std::vector<std::uint8_t> data) {
+        addContent({{"type", type}, {"mimeType", mime_type}, {"data", json::binary(std::move(data))}});
+    }
+    
+    /**
+     * @brief Mark the result as a tool error (isError: true)
+     */
+    void setError(bool is_error = true) { is_error_ = is_error; }
+    
+    /**
+     * @brief Use a complete result object, as returned by Tool::execute()
+     * 
+     * Replaces anything added so far.
+     */
+    void setResult(json result) {
+        items_.clear();
+        is_error_ = false;
+        result_binary_ = contains_binary(result);
+        result_ = std::move(result);
+        has_result_ = true;
+    }
+    
+    /**
+     * @brief Write the result object as JSON
+     */
+    void writeTo(const std::shared_ptr<ChunkedJsonWriter>& out) const;
+    
+    /**
+     * @brief The result object as a json tree, binary data left as is
+     * 
+     * For CBOR and MessagePack responses. Unlike writeTo() this copies all
+     * text, spooled text included, into memory.
+     */
+    json toJson() const {
+        if (has_result_) {
+            return result_;
+        }
+        json content = json::array();
+        for (const auto& item : items_) {
+            if (item.spool) {
+                content.push_back({{"type", "text"}, {"text", item.spool->readText(0, item.spool->textSize())}});
+            } else if (item.is_text) {
+                content.push_back({{"type", "text"}, {"text", item.text}});
+            } else {
+                content.push_back(item.block);
+            }
+        }
+        json result = {{"content", std::move(content)}};
+        if (is_error_) {
+            result["isError"] = true;
+        }
+        return result;
+    }
+    
+    /**
+     * @brief Split a result given to setResult() back into content items
+     * 
+     * Needed before the items can be read one by one. A result without a
+     * content array is left as it is.
+     * @return Whether the result now consists of items
+     */
+    bool expandResult() {
+        if (has_result_) {
+            if (!result_.contains("content") || !result_["content"].is_array()) {
+                return false;
+            }
+            json result = std::move(result_);
+            result_ = json();
+            has_result_ = false;
+            for (auto& block : result["content"]) {
+                if (block.value("type", "") == "text" && block.contains("text") && block["text"].is_string()) {
+                    addText(block["text"].get<std::string>());
+                } else {
+                    addContent(std::move(block));
+                }
+            }
+            is_error_ = result.value("isError", false);
+        }
+        return true;
+    }
+    
+    // Item by item access, for results that are sent in pages (after expandResult())
+    size_t itemCount() const { return items_.size(); }
+    bool isError() const { return is_error_; }
+    bool isText(size_t i) const { return items_[i].is_text; }
+    const json& block(size_t i) const { return items_[i].block; }
+    
+    /**
+     * @brief Length of a text item in bytes
+     */
+    uint64_t textSize(size_t i) const {
+        return items_[i].spool ? items_[i].spool->textSize() : items_[i].text.size();
+    }
+    
+    /**
+     * @brief Bytes [offset, offset + length) of a text item, clamped to its end
+     */
+    std::string readText(size_t i, uint64_t offset, size_t length) const {
+        if (items_[i].spool) {
+            return items_[i].spool->readText(offset, length);
+        }
+        std::string_view text = items_[i].text;
+        return offset < text.size() ? std::string(text.substr(offset, length)) : std::string();
+    }
+    
+private:
+    struct Item {
+        bool is_text = true;
+        bool binary = false;
+        std::string_view text;
+        std::shared_ptr<const void> keep_alive;
+        std::shared_ptr<const SpooledText> spool;
+        json block;
+    };
+    
+    std::vector<Item> items_;
+    bool is_error_ = false;
+    json result_;
+    bool has_result_ = false;
+    bool result_binary_ = false;
+};
+
+/**
+ * @brief Represents a property in the tool's input schema
+ */
+struct ToolProperty {
+    std::string name;
+    std::string type;
+    std::string description;
+    bool required = false;
+    
+    ToolProperty(const std::string& n, const std::string& t, const std::string& d, bool req = false)
+        : name(n), type(t), description(d), required(req) {}
+};
+
+/**
+ * @brief Base class for MCP tools
+ * 
+ * To create a new tool, inherit from this class and implement:
+ * - getName(): Return the tool's unique name
+ * - getDescription(): Return a description of what the tool does
+ * - getProperties(): Return the input schema properties
+ * - execute(): Implement the tool's logic, either the plain overload, the
+ *   one taking a ToolContext if the tool needs to see the request deadline,
+ *   or the one taking a ToolResultWriter to stream large results
+ * 
+ * and optionally getCompletionProvider() to suggest argument values.
+ */
+class Tool {
+public:
+    virtual ~Tool() = default;
+    
+    /**
+     * @brief Get the unique name of the tool
+     */
+    virtual std::string getName() const = 0;
+    
+    /**
+     * @brief Get a description of what the tool does
+     */
+    virtual std::string getDescription() const = 0;
+    
+    /**
+     * @brief Get the input schema properties for the tool
+     */
+    virtual std::vector<ToolProperty> getProperties() const = 0;
+    
+    /**
+     * @brief Execute the tool with the given arguments
+     * 
+     * Every tool must override one of the execute() overloads. The default
+     * throws, so a tool that overrides none fails with -32603 and is
+     * journaled as "error" rather than looking like a successful call.
+     * @param arguments JSON object containing the tool arguments
+     * @return JSON result to be sent back to the client
+     */
+    virtual json execute(const json& /*arguments*/) {
+        throw std::logic_error("Tool '" + getName() + "' does not implement execute()");
+    }
+    
+    /**
+     * @brief Execute the tool with the given arguments and call context
+     * 
+     * The default forwards to execute(arguments), so simple tools only
+     * override that one.
+     * @param arguments JSON object containing the tool arguments
+     * @param context Call context (deadline, cancellation, session state, arena, log)
+     * @return JSON result to be sent back to the client
+     */
+    virtual json execute(const json& arguments, ToolContext& /*context*/) {
+        return execute(arguments);
+    }
+    
+    /**
+     * @brief Execute the tool, writing the result straight into the response
+     * 
+     * The server always calls this overload. The default stores the JSON
+     * returned by execute(arguments, context); override it to emit large
+     * text through the writer without building a json tree first.
+     * @param arguments JSON object containing the tool arguments
+     * @param context Call context (deadline, cancellation, session state, arena, log)
+     * @param result Receives the result content
+     */
+    virtual void execute(const json& arguments, ToolContext& context, ToolResultWriter& result) {
+        result.setResult(execute(arguments, context));
+    }
+    
+    /**
+     * @brief Completions for an argument, or nullptr if it has none
+     * 
+     * Backs completion/complete. Keep the provider as a member (a
+     * PrefixIndex, typically) and update it as the value domain changes.
+     */
+    virtual std::shared_ptr<const CompletionProvider> getCompletionProvider(const std::string& /*argument*/) const {
+        return nullptr;
+    }
+    
+    /**
+     * @brief Generate the JSON schema for tools/list response
+     */
+    json getSchema() const {
+        json properties = json::object();
+        json required_props = json::array();
+        
+        for (const auto& prop : getProperties()) {
+            properties[prop.name] = {
+                {"type", prop.type},
+                {"description", prop.description}
+            };
+            if (prop.required) {
+                required_props.push_back(prop.name);
+            }
+        }
+        
+        return {
+            {"name", getName()},
+            {"description", getDescription()},
+            {"inputSchema", {
+                {"type", "object"},
+                {"properties", properties},
+                {"required", required_props}
+            }}
+        };
+    }
+    
+protected:
+    /**
+     * @brief Helper to create a text content response
+     */
+    static json createTextContent(const std::string& text) {
+        return {
+            {"content", json::array({
+                {
+                    {"type", "text"},
+                    {"text", text}
+                }
+            })}
+        };
+    }
+    
+    /**
+     * @brief Helper to create an error response
+     */
+    static json createErrorContent(const std::string& error) {
+        return {
+            {"content", json::array({
+                {
+                    {"type", "text"},
+                    {"text", "Error: " + error}
+                }
+            })},
+            {"isError", true}
+        };
+    }
+};
+
+/**
+ * @brief Registry for managing MCP tools
+ * 
+ * Use this class to register tools and retrieve them by name.
+ * This is a singleton - use ToolRegistry::instance() to access it.
+ * 
+ * Tools may be registered or removed while the server runs. Every change
+ * bumps epoch() and is recorded in a bounded changelog, from which
+ * changesSince() builds the delta a client needs to catch up.
+ */
+class ToolRegistry {
+public:
+    /**
+     * @brief Number of changes kept for delta updates
+     */
+    static constexpr size_t kMaxChangelog = 1024;
+    
+
+    static ToolRegistry& instance() {
+        static ToolRegistry registry;
+        return registry;
+    }
+    
+    /**
+     * @brief Register a tool with the registry
+     * @param tool Shared pointer to the tool instance
+     */
+    void registerTool(std::shared_ptr<Tool> tool) {
+        std::string name = tool->getName();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto& slot = tools_[name];
+            ToolChange::Kind kind = slot ? ToolChange::Modified : ToolChange::Added;
+            slot = std::move(tool);
+            record_change(name, kind);
+        }
+        std::cout << "Registered tool: " << name << std::endl;
+        notify_change();
+    }
+    
+    /**
+     * @brief Remove a tool; returns false if it was not registered
+     */
+    bool unregisterTool(const std::string& name) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (tools_.erase(name) == 0) {
+                return false;
+            }
+            record_change(name, ToolChange::Removed);
+        }
+        notify_change();
+        return true;
+    }
+    
+    /**
+     * @brief Call a function (outside the registry lock) after every change
+     * 
+     * The server uses this to broadcast notifications/tools/list_changed.
+     */
+    void setChangeListener(std::function<void(uint64_t epoch)> listener) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        listener_ = std::move(listener);
+    }
+    
+    /**
+     * @brief Register a tool by creating it in place
+     * @tparam T The tool class type
+     * @tparam Args Constructor argument types
+     * @param args Constructor arguments
+     */
+    template<typename T, typename... Args>
+    void registerTool(Args&&... args) {
+        auto tool = std::make_shared<T>(std::forward<Args>(args)...);
+        registerTool(tool);
+    }
+    
+    /**
+     * @brief Get a tool by name
+     * @param name The tool name
+     * @return Shared pointer to the tool, or nullptr if not found
+     */
+    std::shared_ptr<Tool> getTool(const std::string& name) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = tools_.find(name);
+        if (it != tools_.end()) {
+            return it->second;
+        }
+        return nullptr;
+    }
+    
+    /**
+     * @brief Check if a tool exists
+     */
+    bool hasTool(const std::string& name) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return tools_.find(name) != tools_.end();
+    }
+    
+    /**
+     * @brief Get a snapshot of all registered tools
+     * @param epoch If given, receives the epoch the snapshot belongs to
+     */
+    std::unordered_map<std::string, std::shared_ptr<Tool>> getAllTools(uint64_t* epoch = nullptr) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (epoch) {
+            *epoch = epoch_.load(std::memory_order_relaxed);
+        }
+        return tools_;
+    }
+    
+    /**
+     * @brief Version counter bumped on every change to the registered tools
+     */
+    uint64_t epoch() const {
+        return epoch_.load(std::memory_order_acquire);
+    }
+    
+    /**
+     * @brief Get the JSON array of all tool schemas for tools/list
+     */
+    json getToolsList() const {
+        json tools_array = json::array();
+        for (const auto& [name, tool] : getAllTools()) {
+            tools_array.push_back(tool->getSchema());
+        }
+        return tools_array;
+    }
+    
+    /**
+     * @brief Describe how the catalog changed after a given epoch
+     * 
+     * Fills delta with {"since", "epoch", "added", "modified", "removed"}:
+     * schemas for tools that are new or changed, names for tools that are
+     * gone. A tool added and removed again within the window is left out.
+     * @return false if the changelog no longer reaches back to since (or
+     *         since is from the future); the client must refetch everything
+     */
+    bool changesSince(uint64_t since, json& delta) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t current = epoch_.load(std::memory_order_relaxed);
+        if (since > current || since < changelog_floor_) {
+            return false;
+        }
+        
+        // Whether each touched tool existed at `since` follows from its first later change
+        std::unordered_map<std::string, bool> existed;
+        auto first = std::upper_bound(changelog_.begin(), changelog_.end(), since,
+            [](uint64_t epoch, const ToolChange& change) { return epoch < change.epoch; });
+        for (auto it = first; it != changelog_.end(); ++it) {
+            existed.emplace(it->name, it->kind != ToolChange::Added);
+        }
+        
+        delta = {
+            {"since", since},
+            {"epoch", current},
+            {"added", json::array()},
+            {"modified", json::array()},
+            {"removed", json::array()}
+        };
+        for (const auto& [name, before] : existed) {
+            auto it = tools_.find(name);
+            if (it == tools_.end()) {
+                if (before) {
+                    delta["removed"].push_back(name);
+                }
+            } else {
+                delta[before ? "modified" : "added"].push_back(it->second->getSchema());
+            }
+        }
+        return true;
+    }
+    
+private:
+    struct ToolChange {
+        enum Kind { Added, Modified, Removed };
+        uint64_t epoch;
+        std::string name;
+        Kind kind;
+    };
+    
+    ToolRegistry() = default;
+    
+    void notify_change() {
+        std::function<void(uint64_t)> listener;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            listener = listener_;
+        }
+        if (listener) {
+            listener(epoch());
+        }
+    }
+    
+    // Caller holds mutex_
+    void record_change(const std::string& name, ToolChange::Kind kind) {
+        uint64_t epoch = epoch_.load(std::memory_order_relaxed) + 1;
+        changelog_.push_back(ToolChange{epoch, name, kind});
+        if (changelog_.size() > kMaxChangelog) {
+            changelog_floor_ = changelog_.front().epoch;
+            changelog_.pop_front();
+        }
+        epoch_.store(epoch, std::memory_order_release);
+    }
+    
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, std::shared_ptr<Tool>> tools_;
+    std::deque<ToolChange> changelog_;     // ascending epochs, one entry per change
+    uint64_t changelog_floor_ = 0;         // oldest epoch a delta can start from
+    std::function<void(uint64_t)> listener_;
+    std::atomic<uint64_t> epoch_{0};
+};
+
+// ============================================================================
+// Built-in Tools
+// ============================================================================
+
+/**
+ * @brief Echo tool - echoes back the input text
+ */
+class EchoTool : public Tool {
+public:
+    std::string getName() const override {
+        return "echo";
+    }
+    
+    std::string getDescription() const override {
+        return "Echoes back the input text";
+    }
+    
+    std::vector<ToolProperty> getProperties() const override {
+        return {
+            ToolProperty("text", "string", "Text to echo back", true)
+        };
+    }
+    
+    using Tool::execute;
+    
+    json execute(const json& arguments) override {
+        std::string text = arguments.value("text", "");
+        return createTextContent("Echo: " + text);
+    }
+};
+
+// ============================================================================
+// CPU Placement and Buffer Pools
+// ============================================================================
+
+/**
+ * @brief Parse a CPU list such as "0-3,8,10-11"
+ */
+std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    std::istringstream iss(list);
+    std::string range;
+    while (std::getline(iss, range, ',')) {
+        if (range.empty()) {
+            continue;
+        }
+        auto dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        if (first < 0 || last < first) {
+            throw std::invalid_argument("Invalid CPU range: " + range);
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+/**
+ * @brief Pin the calling thread to a single CPU (Linux only)
+ */
+bool pin_current_thread(int cpu) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief NUMA node the calling thread is running on, or -1 if unknown
+ */
+int current_numa_node() {
+#if defined(__linux__)
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) {
+        return static_cast<int>(node);
+    }
+#endif
+    return -1;
+}
+
+/**
+ * @brief Per-thread pool of fixed-size I/O blocks on the thread's NUMA node
+ * 
+ * Each thread gets its own pool the first time it calls local(). Blocks are
+ * mmap'd, bound to the thread's node with mbind(MPOL_PREFERRED) and touched
+ * by that thread, so both the policy and first-touch keep them node-local.
+ * A block may be released from any thread; it always returns to its owner.
+ */
+class BufferPool {
+public:
+    static constexpr size_t kBlockSize = 64 * 1024;
+    static constexpr size_t kMaxFreeBlocks = 64;
+    static constexpr size_t kPrefaultBlocks = 8;
+    
+    /**
+     * @brief Block handed out by a pool, returned to it on destruction
+     * 
+     * Requests larger than a block get a plain heap allocation instead.
+     */
+    class Buffer {
+    public:
+        Buffer() = default;
+        Buffer(Buffer&& other) noexcept
+            : owner_(other.owner_), data_(other.data_), capacity_(other.capacity_) {
+            other.data_ = nullptr;
+        }
+        Buffer& operator=(Buffer&& other) noexcept {
+            if (this != &other) {
+                reset();
+                owner_ = other.owner_;
+                data_ = other.data_;
+                capacity_ = other.capacity_;
+                other.data_ = nullptr;
+            }
+            return *this;
+        }
+        ~Buffer() { reset(); }
+        
+        char* data() const { return data_; }
+        size_t capacity() const { return capacity_; }
+        
+        void reset() {
+            if (!data_) {
+                return;
+            }
+            if (owner_) {
+                owner_->release(data_);
+            } else {
+                delete[] data_;
+            }
+            data_ = nullptr;
+        }
+        
+    private:
+        friend class BufferPool;
+        Buffer(BufferPool* owner, char* data, size_t capacity)
+            : owner_(owner), data_(data), capacity_(capacity) {}
+        
+        BufferPool* owner_ = nullptr;
+        char* data_ = nullptr;
+        size_t capacity_ = 0;
+    };
+    
+    /**
+     * @brief The calling thread's pool
+     */
+    static BufferPool& local() {
+        // Never freed: outstanding blocks may outlive the thread that owns them
+        static thread_local BufferPool* pool = new BufferPool(current_numa_node());
+        return *pool;
+    }
+    
+    /**
+     * @brief Get a buffer of at least size bytes
+     */
+    Buffer acquire(size_t size = kBlockSize) {
+        if (size > kBlockSize) {
+            return Buffer(nullptr, new char[size], size);
+        }
+        char* block = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!free_.empty()) {
+                block = free_.back();
+                free_.pop_back();
+            }
+        }
+        if (!block) {
+            block = allocate_block();
+        }
+        return Buffer(this, block, kBlockSize);
+    }
+    
+    /**
+     * @brief Pre-allocate (and fault in) blocks up to the given free count
+     */
+    void reserve(size_t blocks) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (free_.size() < blocks) {
+            free_.push_back(allocate_block());
+        }
+    }
+    
+    int node() const { return node_; }
+    
+private:
+    explicit BufferPool(int node) : node_(node) {}
+    
+    void release(char* block) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (free_.size() < kMaxFreeBlocks) {
+                free_.push_back(block);
+                return;
+            }
+        }
+        free_block(block);
+    }
+    
+    char* allocate_block() {
+#if defined(__linux__)
+        void* memory = mmap(nullptr, kBlockSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        if (node_ >= 0 && node_ < 64) {
+            unsigned long nodemask = 1UL << node_;
+            syscall(SYS_mbind, memory, kBlockSize, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8, 0);
+        }
+        char* block = static_cast<char*>(memory);
+#else
+        char* block = new char[kBlockSize];
+#endif
+        // First touch from the owning thread places the pages
+        std::memset(block, 0, kBlockSize);
+        return block;
+    }
+    
+    static void free_block(char* block) {
+#if defined(__linux__)
+        munmap(block, kBlockSize);
+#else
+        delete[] block;
+#endif
+    }
+    
+    int node_;
+    std::mutex mutex_;
+    std::vector<char*> free_;
+};
+
+/**
+ * @brief Spin-wait hint for busy loops
+ */
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/**
+ * @brief Lock all current and future memory so the request path never page-faults
+ * 
+ * Skipped under a finite RLIMIT_MEMLOCK unless running as root: MCL_FUTURE
+ * would make every later allocation past the limit (thread stacks, buffer
+ * pools) fail with EAGAIN instead of just leaving memory pageable.
+ */
+bool lock_process_memory() {
+#if defined(__linux__)
+    rlimit limit{};
+    if (geteuid() != 0 && (getrlimit(RLIMIT_MEMLOCK, &limit) != 0 || limit.rlim_cur != RLIM_INFINITY)) {
+        return false;
+    }
+    return mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Touch the top of the calling thread's stack so it is resident
+ */
+void prefault_stack() {
+    constexpr size_t kBytes = 256 * 1024;
+    volatile char stack[kBytes];
+    for (size_t i = 0; i < kBytes; i += 4096) {
+        stack[i] = 0;
+    }
+    (void)stack[0];
+}
+
+/**
+ * @brief Move the calling thread into the SCHED_FIFO real-time class
+ */
+bool set_realtime_priority(int priority) {
+#if defined(__linux__)
+    sched_param param{};
+    param.sched_priority = priority;
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Pin the calling thread to its slot in a CPU list and warm its pool
+ * @param cpus CPU list from the configuration (empty = leave unpinned)
+ * @param index Thread index; thread i takes cpus[i % cpus.size()]
+ * @param role Name used in diagnostics
+ */
+void place_current_thread(const std::vector<int>& cpus, size_t index, const char* role) {
+    if (cpus.empty()) {
+        return;
+    }
+    int cpu = cpus[index % cpus.size()];
+    if (!pin_current_thread(cpu)) {
+        std::cerr << "Could not pin " << role << " thread " << index << " to CPU " << cpu << std::endl;
+        return;
+    }
+    // Now that the thread sits on its final CPU, fault in its pool there
+    BufferPool::local().reserve(BufferPool::kPrefaultBlocks);
+}
+
+// ============================================================================
+// Response Streaming
+// ============================================================================
+
+/**
+ * @brief Encoding of JSON-RPC bodies, chosen per request by Content-Type and Accept
+ */
+enum class WireFormat { Json, Cbor, MsgPack };
+
+inline const char* wire_format_content_type(WireFormat format) {
+    switch (format) {
+        case WireFormat::Cbor: return "application/cbor";
+        case WireFormat::MsgPack: return "application/msgpack";
+        default: return "application/json";
+    }
+}
+
+/**
+ * @brief Format named by a media type (parameters such as charset ignored)
+ * @return false if the type is none of the three
+ */
+inline bool parse_wire_format(std::string_view media_type, WireFormat& format) {
+    media_type = media_type.substr(0, media_type.find(';'));
+    while (!media_type.empty() && media_type.back() == ' ') {
+        media_type.remove_suffix(1);
+    }
+    while (!media_type.empty() && media_type.front() == ' ') {
+        media_type.remove_prefix(1);
+    }
+    if (media_type == "application/cbor") {
+        format = WireFormat::Cbor;
+    } else if (media_type == "application/msgpack" || media_type == "application/x-msgpack") {
+        format = WireFormat::MsgPack;
+    } else if (media_type == "application/json") {
+        format = WireFormat::Json;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief A pooled block holding part of a serialized response
+ */
+struct OutputChunk {
+    BufferPool::Buffer buffer;
+    size_t size = 0;
+};
+
+/**
+ * @brief Thrown into the serializer to abandon a response nobody will read
+ */
+struct StreamAborted : std::runtime_error {
+    StreamAborted() : std::runtime_error("Response stream aborted") {}
+};
+
+/**
+ * @brief nlohmann output adapter that serializes into fixed-size pooled blocks
+ * 
+ * Each block is handed to the sink as soon as it is full, so a response never
+ * exists as one contiguous string. The partially filled last block stays with
+ * the writer until takeTail() is called.
+ */
+class ChunkedJsonWriter : public nlohmann::detail::output_adapter_protocol<char> {
+public:
+    using Sink = std::function<void(OutputChunk&&)>;
+    using FileSink = std::function<void(FileRegion&&)>;
+    
+    explicit ChunkedJsonWriter(Sink sink) : sink_(std::move(sink)) {}
+    
+    /**
+     * @brief Let file regions bypass the blocks (e.g. to be sent with sendfile)
+     * 
+     * Without a file sink, write_file() copies the bytes into blocks.
+     */
+    void setFileSink(FileSink sink) { file_sink_ = std::move(sink); }
+    
+    void write_character(char c) override {
+        if (!current_.buffer.data() || current_.size == current_.buffer.capacity()) {
+            next_block();
+        }
+        current_.buffer.data()[current_.size++] = c;
+    }
+    
+    void write_characters(const char* s, std::size_t length) override {
+        while (length > 0) {
+            if (!current_.buffer.data() || current_.size == current_.buffer.capacity()) {
+                next_block();
+            }
+            size_t n = std::min(length, current_.buffer.capacity() - current_.size);
+            std::memcpy(current_.buffer.data() + current_.size, s, n);
+            current_.size += n;
+            s += n;
+            length -= n;
+        }
+    }
+    
+    /**
+     * @brief Write a string literal
+     */
+    template<size_t N>
+    void write_literal(const char (&text)[N]) {
+        write_characters(text, N - 1);
+    }
+    
+    /**
+     * @brief Serialize a value (compact, same output as json::dump())
+     */
+    static void dump(const json& value, const std::shared_ptr<ChunkedJsonWriter>& writer) {
+        nlohmann::detail::serializer<json> serializer(writer, ' ');
+        serializer.dump(value, false, false, 0);
+    }
+    
+    /**
+     * @brief Serialize a value in the given format
+     * 
+     * CBOR and MessagePack carry binary values as byte strings. Encode them
+     * as base64 first (binary_as_base64()) before writing JSON.
+     */
+    static void encode(const json& value, WireFormat format, const std::shared_ptr<ChunkedJsonWriter>& writer) {
+        if (format == WireFormat::Json) {
+            dump(value, writer);
+            return;
+        }
+        nlohmann::detail::binary_writer<json, char> binary(writer);
+        if (format == WireFormat::Cbor) {
+            binary.write_cbor(value);
+        } else {
+            binary.write_msgpack(value);
+        }
+    }
+    
+    /**
+     * @brief Write a region of a spooled file
+     * 
+     * With a file sink, the block filled so far is handed on first, so the
+     * sinks see the output in order.
+     */
+    void write_file(FileRegion region) {
+        if (file_sink_) {
+            if (current_.buffer.data() && current_.size > 0) {
+                blocks_emitted_++;
+                sink_(std::move(current_));
+                current_ = OutputChunk();
+            }
+            blocks_emitted_++;
+            file_sink_(std::move(region));
+            return;
+        }
+        
+        while (region.length > 0) {
+            if (!current_.buffer.data() || current_.size == current_.buffer.capacity()) {
+                next_block();
+            }
+            size_t n = std::min(region.length, current_.buffer.capacity() - current_.size);
+            n = region.text->read(region.offset, current_.buffer.data() + current_.size, n);
+            if (n == 0) {
+                throw std::runtime_error("Spooled tool result is shorter than expected");
+            }
+            current_.size += n;
+            region.offset += n;
+            region.length -= n;
+        }
+    }
+    
+    /**
+     * @brief Take the last, partially filled block (may be empty)
+     */
+    OutputChunk takeTail() {
+        return std::move(current_);
+    }
+    
+    /**
+     * @brief Number of full blocks handed to the sink so far
+     */
+    size_t blocksEmitted() const { return blocks_emitted_; }
+    
+private:
+    void next_block() {
+        if (current_.buffer.data()) {
+            blocks_emitted_++;
+            sink_(std::move(current_));
+        }
+        current_.buffer = BufferPool::local().acquire();
+        current_.size = 0;
+    }
+    
+    Sink sink_;
+    FileSink file_sink_;
+    OutputChunk current_;
+    size_t blocks_emitted_ = 0;
+};
+
+/**
+ * @brief Write text as a JSON string literal, escaping as json::dump() does
+ */
+inline void write_json_string(ChunkedJsonWriter& out, std::string_view text) {
+    out.write_character('"');
+    write_json_escaped(out, text);
+    out.write_character('"');
+}
+
+inline void ToolResultWriter::writeTo(const std::shared_ptr<ChunkedJsonWriter>& out) const {
+    if (has_result_) {
+        ChunkedJsonWriter::dump(result_binary_ ? binary_as_base64(result_) : result_, out);
+        return;
+    }
+    
+    // Keys in the order json::dump() would produce them
+    out->write_literal("{\"content\":[");
+    for (size_t i = 0; i < items_.size(); ++i) {
+        if (i > 0) {
+            out->write_character(',');
+        }
+        if (items_[i].spool) {
+            const SpooledText& spool = *items_[i].spool;
+            out->write_literal("{\"text\":\"");
+            if (spool.spilled()) {
+                out->write_file(FileRegion{items_[i].spool, 0, spool.size()});
+            } else {
+                out->write_characters(spool.memory().data(), spool.memory().size());
+            }
+            out->write_literal("\",\"type\":\"text\"}");
+        } else if (items_[i].is_text) {
+            out->write_literal("{\"text\":");
+            write_json_string(*out, items_[i].text);
+            out->write_literal(",\"type\":\"text\"}");
+        } else {
+            ChunkedJsonWriter::dump(items_[i].binary ? binary_as_base64(items_[i].block) : items_[i].block, out);
+        }
+    }
+    out->write_character(']');
+    if (is_error_) {
+        out->write_literal(",\"isError\":true");
+    }
+    out->write_character('}');
+}
+
+// ============================================================================
+// Server Configuration and Tool Execution
+// ============================================================================
+
+/**
+ * @brief MCP revision spoken on every transport
+ */
+constexpr const char* kProtocolVersion = "2024-11-05";
+
+/**
+ * @brief Runtime options, filled from the command line in main()
+ */
+struct ServerConfig {
+    short port = 3000;
+    // Deadline applied to requests that do not carry one (0 = none)
+    std::chrono::milliseconds default_timeout{0};
+    // Tool worker threads (0 = hardware concurrency)
+    size_t worker_threads = 0;
+    // io shards; 1 runs everything on the main thread
+    size_t shards = 1;
+    // Pin shard i to CPU i (unless io_cpus says otherwise)
+    bool pin_shards = false;
+    // CPUs for io shards and tool workers; thread i takes list[i % size]
+    std::vector<int> io_cpus;
+    std::vector<int> worker_cpus;
+    // Busy-poll io threads instead of blocking in the kernel
+    bool low_latency = false;
+    // SO_BUSY_POLL budget on sockets in low-latency mode (microseconds)
+    int busy_poll_us = 50;
+    // SCHED_FIFO priority for io threads (0 = normal scheduling)
+    int rt_priority = 0;
+    // How long a session outlives its SSE stream, waiting for a reconnect
+    std::chrono::seconds session_linger{300};
+    // Recent SSE events kept per session for Last-Event-ID replay
+    size_t replay_events = 256;
+    // Directory for session snapshots (empty = sessions are not persisted)
+    std::string session_store;
+    // Tool call journal (empty = no journal) and its group-commit interval
+    std::string journal;
+    std::chrono::milliseconds journal_sync{5};
+    // Make a tool call wait for the sync of its start record before it runs
+    bool journal_wait_sync = false;
+    // Results buffered for paged reads (0 = paging off), dropped when unread for result_ttl
+    size_t result_buffers = 64;
+    std::chrono::seconds result_ttl{120};
+    // Log notifications per session: sustained records per second and burst size
+    double log_rate = 50;
+    double log_burst = 100;
+    // Unix socket for the shared-memory transport (empty = off) and the size of each ring
+    std::string shm_socket;
+    size_t shm_ring_bytes = 1 << 20;
+    // Shared-memory channels open at once; each has a thread and a memfd
+    size_t shm_max_channels = 64;
+    // Print every request body as it arrives (debugging; costs a re-serialization per request)
+    bool trace_requests = false;
+};
+
+/**
+ * @brief Lock-free work-stealing deque (Chase-Lev)
+ * 
+ * The owning worker pushes and pops at the bottom, any other thread steals
+ * from the top. Follows Le et al., "Correct and Efficient Work-Stealing for
+ * Weak Memory Models" (PPoPP 2013). Arrays replaced on growth are kept until
+ * the deque is destroyed because a concurrent thief may still read them.
+ */
+template<typename T>
+class WorkStealingDeque {
+    static_assert(std::is_pointer<T>::value, "WorkStealingDeque stores pointers");
+    
+public:
+    explicit WorkStealingDeque(int64_t capacity = 256) {
+        arrays_.push_back(std::make_unique<Array>(capacity));
+        array_.store(arrays_.back().get(), std::memory_order_relaxed);
+    }
+    
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+    
+    /**
+     * @brief Push an item at the bottom (owner only)
+     */
+    void push(T item) {
+        int64_t b = bottom_.load(std::memory_order_relaxed);
+        int64_t t = top_.load(std::memory_order_acquire);
+        Array* a = array_.load(std::memory_order_relaxed);
+        if (b - t > a->capacity - 1) {
+            a = grow(a, t, b);
+        }
+        a->put(b, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+    
+    /**
+     * @brief Pop the most recently pushed item (owner only)
+     */
+    bool pop(T& item) {
+        int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+        Array* a = array_.load(std::memory_order_relaxed);
+        bottom_.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top_.load(std::memory_order_relaxed);
+        
+        if (t > b) {
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        
+        item = a->get(b);
+        if (t == b) {
+            // Last item - race against thieves for it
+            bool won = top_.compare_exchange_strong(t, t + 1,
+                std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+    
+    /**
+     * @brief Steal the oldest item (any thread)
+     */
+    bool steal(T& item) {
+        int64_t t = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom_.load(std::memory_order_acquire);
+        
+        if (t >= b) {
+            return false;
+        }
+        
+        Array* a = array_.load(std::memory_order_acquire);
+        T candidate = a->get(t);
+        if (!top_.compare_exchange_strong(t, t + 1,
+                std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return false;
+        }
+        item = candidate;
+        return true;
+    }
+    
+    bool empty() const {
+        return bottom_.load(std::memory_order_relaxed) <= top_.load(std::memory_order_relaxed);
+    }
+    
+private:
+    struct Array {
+        explicit Array(int64_t cap) : capacity(cap), mask(cap - 1), slots(new std::atomic<T>[cap]) {}
+        
+        // Acquire/release on the slots themselves (free on x86) so the task
+        // a pointer refers to is published without relying on fences alone
+        T get(int64_t i) const { return slots[i & mask].load(std::memory_order_acquire); }
+        void put(int64_t i, T item) { slots[i & mask].store(item, std::memory_order_release); }
+        
+        int64_t capacity;
+        int64_t mask;
+        std::unique_ptr<std::atomic<T>[]> slots;
+    };
+    
+    Array* grow(Array* old, int64_t t, int64_t b) {
+        auto bigger = std::make_unique<Array>(old->capacity * 2);
+        for (int64_t i = t; i < b; ++i) {
+            bigger->put(i, old->get(i));
+        }
+        Array* raw = bigger.get();
+        arrays_.push_back(std::move(bigger));
+        array_.store(raw, std::memory_order_release);
+        return raw;
+    }
+    
+    alignas(64) std::atomic<int64_t> top_{0};
+    alignas(64) std::atomic<int64_t> bottom_{0};
+    std::atomic<Array*> array_{nullptr};
+    std::vector<std::unique_ptr<Array>> arrays_;
+};
+
+/**
+ * @brief Wait/notify on a 32-bit epoch counter
+ * 
+ * Uses the futex syscall on Linux and a mutex/condition variable elsewhere.
+ * A waiter snapshots epoch(), re-checks for work, then calls wait(snapshot);
+ * any notify in between bumps the epoch so the wait returns immediately.
+ */
+class EpochWaiter {
+public:
+    uint32_t epoch() const {
+        return epoch_.load(std::memory_order_seq_cst);
+    }
+    
+    void wait(uint32_t seen) {
+#if defined(__linux__)
+        while (epoch_.load(std::memory_order_seq_cst) == seen) {
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch_), FUTEX_WAIT_PRIVATE,
+                    seen, nullptr, nullptr, 0);
+        }
+#else
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this, seen] { return epoch_.load() != seen; });
+#endif
+    }
+    
+    /**
+     * @brief Advance the epoch and wake up to count waiters
+     */
+    void notify(int count) {
+#if defined(__linux__)
+        epoch_.fetch_add(1, std::memory_order_seq_cst);
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch_), FUTEX_WAKE_PRIVATE,
+                count, nullptr, nullptr, 0);
+#else
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            epoch_.fetch_add(1, std::memory_order_seq_cst);
+        }
+        if (count == 1) {
+            cv_.notify_one();
+        } else {
+            cv_.notify_all();
+        }
+#endif
+    }
+    
+    /**
+     * @brief Advance the epoch without waking anyone
+     */
+    void bump() {
+#if defined(__linux__)
+        epoch_.fetch_add(1, std::memory_order_seq_cst);
+#else
+        std::lock_guard<std::mutex> lock(mutex_);
+        epoch_.fetch_add(1, std::memory_order_seq_cst);
+#endif
+    }
+    
+private:
+    std::atomic<uint32_t> epoch_{0};
+#if !defined(__linux__)
+    std::mutex mutex_;
+    std::condition_variable cv_;
+#endif
+};
+
+/**
+ * @brief Group of subtasks spawned by a tool onto the tool executor
+ * 
+ * Lets tools fan out internally (e.g. a parallel search) on the same worker
+ * threads that run tool calls. wait() runs queued subtasks itself instead of
+ * blocking, so a worker waiting on its children never idles.
+ * 
+ * @code
+ * TaskGroup group(context);
+ * for (auto& shard : shards) {
+ *     group.spawn([&] { search(shard); });
+ * }
+ * group.wait();
+ * @endcode
+ */
+class TaskGroup {
+public:
+    explicit TaskGroup(ToolContext& context) : executor_(context.executor()) {}
+    explicit TaskGroup(ToolExecutor* executor) : executor_(executor) {}
+    
+    ~TaskGroup() {
+        // Children reference this group - never leave with any still queued
+        if (pending_.load(std::memory_order_acquire) > 0) {
+            try {
+                wait();
+            } catch (...) {
+            }
+        }
+    }
+    
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+    
+    /**
+     * @brief Queue a subtask (runs inline if the tool has no executor)
+     */
+    void spawn(std::function<void()> fn);
+    
+    /**
+     * @brief Wait until every spawned subtask has finished
+     * 
+     * Rethrows the first exception thrown by a subtask.
+     */
+    void wait();
+    
+private:
+    friend class ToolExecutor;
+    
+    void finish(std::exception_ptr error) {
+        if (error) {
+            std::lock_guard<std::mutex> lock(error_mutex_);
+            if (!error_) {
+                error_ = error;
+            }
+        }
+        pending_.fetch_sub(1, std::memory_order_acq_rel);
+    }
+    
+    ToolExecutor* executor_;
+    std::atomic<size_t> pending_{0};
+    std::mutex error_mutex_;
+    std::exception_ptr error_;
+};
+
+/**
+ * @brief Work-stealing thread pool for tool calls and their subtasks
+ * 
+ * Tool calls are queued on the workers' own call heaps, ordered
+ * earliest-deadline-first; calls without a deadline run after all of those,
+ * in submission order per heap. A submit locks only one heap: the
+ * submitting thread's home heap, or a much emptier one if the home heap
+ * falls behind, so io threads do not contend on a shared lock. Each heap
+ * publishes its earliest deadline in an atomic; a worker looking for a call
+ * scans those and locks only the heap holding the earliest one, which keeps
+ * the order close to a single EDF queue and lets idle workers look for work
+ * without taking any lock. A call whose deadline passes while it is still
+ * queued is never run - its on_expired callback is invoked instead. A call
+ * whose cancellation token fires while queued is dropped without any callback.
+ * 
+ * Subtasks spawned by tools (TaskGroup) go to the spawning worker's own
+ * Chase-Lev deque. Idle workers steal from a random victim, then take the
+ * earliest call, and finally park on a futex until new work shows up.
+ */
+class ToolExecutor {
+public:
+    explicit ToolExecutor(size_t threads, std::vector<int> cpus = {}) : cpus_(std::move(cpus)) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (size_t i = 0; i < threads; ++i) {
+            workers_.push_back(std::make_unique<Worker>());
+        }
+        for (size_t i = 0; i < threads; ++i) {
+            workers_[i]->thread = std::thread([this, i] { worker_loop(i); });
+        }
+    }
+    
+    ~ToolExecutor() {
+        stopping_.store(true, std::memory_order_seq_cst);
+        waiter_.notify(INT32_MAX);
+        for (auto& worker : workers_) {
+            worker->thread.join();
+        }
+    }
+    
+    ToolExecutor(const ToolExecutor&) = delete;
+    ToolExecutor& operator=(const ToolExecutor&) = delete;
+    
+    /**
+     * @brief Queue a tool call
+     * @param deadline Absolute deadline (time_point::max() if none)
+     * @param cancellation Drops the call if it fires before the call starts
+     * @param run Work to execute on a worker thread
+     * @param on_expired Invoked instead of run if the deadline passes first
+     */
+    void submit(Clock::time_point deadline, CancellationToken cancellation,
+                std::function<void()> run, std::function<void()> on_expired) {
+        push_call(std::make_unique<Job>(Job{deadline, std::move(cancellation), std::move(run), std::move(on_expired)}));
+        wake_one();
+    }
+    
+    size_t threadCount() const { return workers_.size(); }
+    
+private:
+    friend class TaskGroup;
+    
+    struct Job {
+        Clock::time_point deadline;
+        CancellationToken cancellation;
+        std::function<void()> run;
+        std::function<void()> on_expired;
+    };
+    
+    /**
+     * @brief A queued call as the heap holds it; the order is decided without touching the job
+     */
+    struct QueuedJob {
+        int64_t key;        // deadline_key() of the job's deadline
+        uint64_t seq;
+        std::unique_ptr<Job> job;
+    };
+    
+    // The heap functions build a max-heap, so "less" means "later deadline"
+    struct LaterDeadline {
+        bool operator()(const QueuedJob& a, const QueuedJob& b) const {
+            if (a.key != b.key) {
+                return a.key > b.key;
+            }
+            return a.seq > b.seq;
+        }
+    };
+    
+    struct Task {
+        std::function<void()> fn;
+        TaskGroup* group;
+    };
+    
+    /**
+     * @brief One worker's queued calls, a heap under its own lock
+     * 
+     * earliest and size mirror the heap for lock-free scans: the top's
+     * deadline in Clock ticks (kNoDeadline for a call without one, kEmpty
+     * when there is none) and the number of calls.
+     */
+    struct alignas(64) CallHeap {
+        std::mutex mutex;
+        std::vector<QueuedJob> jobs;
+        uint64_t next_seq = 0;
+        std::atomic<int64_t> earliest{kEmpty};
+        std::atomic<size_t> size{0};
+    };
+    
+    struct Worker {
+        WorkStealingDeque<Task*> deque;
+        CallHeap calls;
+        std::thread thread;
+    };
+    
+    static constexpr size_t kNotAWorker = static_cast<size_t>(-1);
+    static constexpr int64_t kEmpty = INT64_MAX;
+    static constexpr int64_t kNoDeadline = INT64_MAX - 1;
+    
+    static int64_t deadline_key(Clock::time_point deadline) {
+        return deadline == Clock::time_point::max()
+            ? kNoDeadline : std::min<int64_t>(deadline.time_since_epoch().count(), kNoDeadline - 1);
+    }
+    
+    /**
+     * @brief Queue a call on the calling worker's heap, or on the submitting thread's home heap
+     */
+    void push_call(std::unique_ptr<Job> job) {
+        size_t index = current_worker();
+        if (index == kNotAWorker) {
+            // Stay on one heap while it keeps up, so its lines stay in this thread's cache
+            static thread_local size_t home = next_random();
+            size_t count = workers_.size();
+            size_t other = next_random() % count;
+            index = home % count;
+            if (workers_[other]->calls.size.load(std::memory_order_relaxed) + 1 <
+                workers_[index]->calls.size.load(std::memory_order_relaxed) / 2) {
+                home = index = other;
+            }
+        }
+        
+        int64_t key = deadline_key(job->deadline);
+        CallHeap& heap = workers_[index]->calls;
+        std::lock_guard<std::mutex> lock(heap.mutex);
+        heap.jobs.push_back(QueuedJob{key, heap.next_seq++, std::move(job)});
+        std::push_heap(heap.jobs.begin(), heap.jobs.end(), LaterDeadline());
+        heap.earliest.store(heap.jobs.front().key, std::memory_order_release);
+        heap.size.store(heap.jobs.size(), std::memory_order_relaxed);
+    }
+    
+    /**
+     * @brief Take the queued call with the earliest deadline over all heaps
+     * 
+     * Ties go to the heap nearest the caller's own. A heap that was emptied
+     * between the scan and the lock just means scanning again.
+     */
+    std::unique_ptr<Job> take_call(size_t index) {
+        size_t count = workers_.size();
+        size_t start = index == kNotAWorker ? 0 : index;
+        for (;;) {
+            size_t best = kNotAWorker;
+            int64_t best_key = kEmpty;
+            size_t candidate = start;
+            for (size_t i = 0; i < count; ++i) {
+                int64_t key = workers_[candidate]->calls.earliest.load(std::memory_order_acquire);
+                if (key < best_key) {
+                    best = candidate;
+                    best_key = key;
+                }
+                if (++candidate == count) {
+                    candidate = 0;
+                }
+            }
+            if (best == kNotAWorker) {
+                return nullptr;
+            }
+            
+            CallHeap& heap = workers_[best]->calls;
+            std::lock_guard<std::mutex> lock(heap.mutex);
+            if (heap.jobs.empty()) {
+                continue;
+            }
+            std::pop_heap(heap.jobs.begin(), heap.jobs.end(), LaterDeadline());
+            std::unique_ptr<Job> job = std::move(heap.jobs.back().job);
+            heap.jobs.pop_back();
+            heap.earliest.store(heap.jobs.empty() ? kEmpty : heap.jobs.front().key, std::memory_order_release);
+            heap.size.store(heap.jobs.size(), std::memory_order_relaxed);
+            return job;
+        }
+    }
+    
+    /**
+     * @brief Index of the calling thread in this pool, or kNotAWorker
+     */
+    size_t current_worker() const {
+        return current_executor_ == this ? current_index_ : kNotAWorker;
+    }
+    
+    void spawn(TaskGroup* group, std::function<void()> fn) {
+        group->pending_.fetch_add(1, std::memory_order_acq_rel);
+        Task* task = new Task{std::move(fn), group};
+        
+        size_t index = current_worker();
+        if (index != kNotAWorker) {
+            workers_[index]->deque.push(task);
+        } else {
+            // Spawned from outside the pool - hand it over as a call without a deadline
+            push_call(std::make_unique<Job>(Job{Clock::time_point::max(), CancellationToken(),
+                                                [this, task] { run_task(task); }, nullptr}));
+        }
+        wake_one();
+    }
+    
+    /**
+     * @brief Run one queued subtask on the calling thread, if any
+     */
+    bool help_one() {
+        if (Task* task = find_task(current_worker())) {
+            run_task(task);
+            return true;
+        }
+        return false;
+    }
+    
+    void wake_one() {
+        if (idle_.load(std::memory_order_seq_cst) > 0) {
+            waiter_.notify(1);
+        } else {
+            waiter_.bump();
+        }
+    }
+    
+    void run_task(Task* task) {
+        std::exception_ptr error;
+        try {
+            task->fn();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        TaskGroup* group = task->group;
+        delete task;
+        group->finish(error);
+    }
+    
+    Task* find_task(size_t index) {
+        Task* task = nullptr;
+        if (index != kNotAWorker && workers_[index]->deque.pop(task)) {
+            return task;
+        }
+        
+        size_t count = workers_.size();
+        size_t start = next_random() % count;
+        for (size_t i = 0; i < count; ++i) {
+            size_t victim = (start + i) % count;
+            if (victim != index && workers_[victim]->deque.steal(task)) {
+                return task;
+            }
+        }
+        return nullptr;
+    }
+    
+    bool run_call(size_t index) {
+        std::unique_ptr<Job> job = take_call(index);
+        if (!job) {
+            return false;
+        }
+        
+        if (job->cancellation.cancelled()) {
+            // Nobody is waiting for the result any more
+            return true;
+        }
+        
+        if (job->deadline != Clock::time_point::max() && Clock::now() >= job->deadline) {
+            if (job->on_expired) {
+                job->on_expired();
+            }
+            return true;
+        }
+        
+        try {
+            job->run();
+        } catch (const std::exception& e) {
+            std::cerr << "Tool worker error: " << e.what() << std::endl;
+        }
+        return true;
+    }
+    
+    bool run_any(size_t index) {
+        if (Task* task = find_task(index)) {
+            run_task(task);
+            return true;
+        }
+        return run_call(index);
+    }
+    
+    void worker_loop(size_t index) {
+        current_executor_ = this;
+        current_index_ = index;
+        place_current_thread(cpus_, index, "tool worker");
+        
+        for (;;) {
+            if (run_any(index)) {
+                continue;
+            }
+            
+            // Snapshot the epoch before the final check so a concurrent
+            // submit cannot slip in between the check and the park
+            uint32_t seen = waiter_.epoch();
+            if (run_any(index)) {
+                continue;
+            }
+            if (stopping_.load(std::memory_order_seq_cst)) {
+                return;
+            }
+            
+            idle_.fetch_add(1, std::memory_order_seq_cst);
+            waiter_.wait(seen);
+            idle_.fetch_sub(1, std::memory_order_seq_cst);
+        }
+    }
+    
+    static uint64_t next_random() {
+        // xorshift64, one stream per thread
+        static thread_local uint64_t state =
+            0x9E3779B97F4A7C15ull ^ std::hash<std::thread::id>()(std::this_thread::get_id());
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+    
+    static inline thread_local ToolExecutor* current_executor_ = nullptr;
+    static inline thread_local size_t current_index_ = 0;
+    
+    std::vector<int> cpus_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    EpochWaiter waiter_;
+    std::atomic<int> idle_{0};
+    std::atomic<bool> stopping_{false};
+};
+
+inline void TaskGroup::spawn(std::function<void()> fn) {
+    if (!executor_) {
+        fn();
+        return;
+    }
+    executor_->spawn(this, std::move(fn));
+}
+
+inline void TaskGroup::wait() {
+    while (pending_.load(std::memory_order_acquire) > 0) {
+        if (!executor_ || !executor_->help_one()) {
+            std::this_thread::yield();
+        }
+    }
+    
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    if (error_) {
+        std::exception_ptr error = error_;
+        error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+// ============================================================================
+// Session Store
+// ============================================================================
+
+/**
+ * @brief Keeps session metadata on disk so clients can resume after a restart
+ * 
+ * Each shard hands over a CBOR snapshot of its session table when it has
+ * changed. A background thread writes it to <dir>/shard-<i>.cbor through a
+ * temporary file and a rename, so a crash leaves either the previous or the
+ * new snapshot. Only the newest pending snapshot of a shard is written.
+ */
+class SessionStore {
+public:
+    explicit SessionStore(std::string directory) : directory_(std::move(directory)) {
+        std::filesystem::create_directories(directory_);
+        thread_ = std::thread([this] { run(); });
+    }
+    
+    ~SessionStore() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        thread_.join();
+    }
+    
+    SessionStore(const SessionStore&) = delete;
+    SessionStore& operator=(const SessionStore&) = delete;
+    
+    /**
+     * @brief Read the session records of every snapshot (before the shards start)
+     * 
+     * Snapshots of shards that no longer exist are deleted after reading;
+     * their sessions cannot be routed with the current shard count.
+     */
+    std::vector<json> load(size_t shards) const {
+        std::vector<json> records;
+        for (const auto& entry : std::filesystem::directory_iterator(directory_)) {
+            std::string name = entry.path().filename().string();
+            size_t shard = 0;
+            if (std::sscanf(name.c_str(), "shard-%zu.cbor", &shard) != 1 ||
+                name != "shard-" + std::to_string(shard) + ".cbor") {
+                continue;
+            }
+            
+            std::ifstream in(entry.path(), std::ios::binary);
+            std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            json snapshot = json::from_cbor(data, true, false);
+            if (snapshot.is_discarded() || !snapshot.is_array()) {
+                std::cerr << "Ignoring unreadable session snapshot " << entry.path() << std::endl;
+            } else {
+                for (auto& record : snapshot) {
+                    records.push_back(std::move(record));
+                }
+            }
+            if (shard >= shards) {
+                std::filesystem::remove(entry.path());
+            }
+        }
+        return records;
+    }
+    
+    /**
+     * @brief Queue a shard's snapshot for writing, replacing any older pending one
+     */
+    void save(size_t shard, std::vector<uint8_t> snapshot) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_[shard] = std::move(snapshot);
+        }
+        cv_.notify_one();
+    }
+    
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+            if (pending_.empty()) {
+                return;
+            }
+            auto batch = std::move(pending_);
+            pending_.clear();
+            lock.unlock();
+            for (const auto& [shard, snapshot] : batch) {
+                write(shard, snapshot);
+            }
+            lock.lock();
+        }
+    }
+    
+    void write(size_t shard, const std::vector<uint8_t>& snapshot) const {
+        std::string path = directory_ + "/shard-" + std::to_string(shard) + ".cbor";
+        std::string temp = path + ".tmp";
+        {
+            std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(snapshot.data()),
+                      static_cast<std::streamsize>(snapshot.size()));
+            if (!out) {
+                std::cerr << "Could not write session snapshot " << temp << std::endl;
+                return;
+            }
+        }
+#if defined(__unix__) || defined(__APPLE__)
+        // Make the data durable before the rename makes it visible
+        int fd = ::open(temp.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            ::fsync(fd);
+            ::close(fd);
+        }
+#endif
+        std::error_code ec;
+        std::filesystem::rename(temp, path, ec);
+        if (ec) {
+            std::cerr << "Could not replace session snapshot " << path << ": " << ec.message() << std::endl;
+            return;
+        }
+#if defined(__unix__) || defined(__APPLE__)
+        // And the rename itself
+        int dir = ::open(directory_.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dir >= 0) {
+            ::fsync(dir);
+            ::close(dir);
+        }
+#endif
+    }
+    
+    std::string directory_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::unordered_map<size_t, std::vector<uint8_t>> pending_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+// ============================================================================
+// Request Journal
+// ============================================================================
+
+/**
+ * @brief Append-only log of tool calls, for finding out what a crash interrupted
+ * 
+ * A "start" record is written when a tool begins executing and an "end"
+ * record when it returns, one JSON object per line. Each record goes to
+ * the file with a single O_APPEND write() before the call proceeds, so it
+ * survives a crash of the process. Only fdatasync is batched: a background
+ * thread syncs once per sync interval, so concurrent calls share a single
+ * sync (group commit) and a machine crash loses at most the records of the
+ * last interval. With wait_for_sync, begin() also waits for the sync that
+ * covers its record, so not even a power loss hides a started call. It is
+ * called on tool workers, never on io threads.
+ */
+class RequestJournal {
+public:
+    /**
+     * @param sync_interval How long records may wait for their sync (0 = sync as soon as possible)
+     * @param wait_for_sync Make begin() return only once its record is synced
+     */
+    RequestJournal(const std::string& path, std::chrono::milliseconds sync_interval, bool wait_for_sync = false)
+        : sync_interval_(sync_interval), wait_for_sync_(wait_for_sync) {
+#if defined(__unix__) || defined(__APPLE__)
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+#else
+        file_ = std::fopen(path.c_str(), "ab");
+        if (!file_) {
+#endif
+            throw std::runtime_error("Cannot open journal " + path + ": " + std::strerror(errno));
+        }
+        thread_ = std::thread([this] { run(); });
+    }
+    
+    ~RequestJournal() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        thread_.join();
+#if defined(__unix__) || defined(__APPLE__)
+        ::close(fd_);
+#else
+        std::fclose(file_);
+#endif
+    }
+    
+    RequestJournal(const RequestJournal&) = delete;
+    RequestJournal& operator=(const RequestJournal&) = delete;
+    
+    /**
+     * @brief Copy start records left open by an earlier run into this journal
+     * 
+     * Call before the first begin(). The records keep their sequence numbers,
+     * new calls are numbered after them, and the next recover() reports them
+     * again, so unresolved calls are not lost when the server restarts twice.
+     */
+    void carry(const std::vector<json>& records) {
+        for (const auto& record : records) {
+            uint64_t seq = record.value("seq", uint64_t{0});
+            if (seq >= next_seq_.load(std::memory_order_relaxed)) {
+                next_seq_.store(seq + 1, std::memory_order_relaxed);
+            }
+            append(record.dump() + "\n");
+        }
+    }
+    
+    /**
+     * @brief Record that a tool call is starting; returns the sequence number for complete()
+     */
+    uint64_t begin(const std::string& session, const json& id, const std::string& tool, const json& arguments) {
+        uint64_t seq = next_seq_.fetch_add(1, std::memory_order_relaxed);
+        using namespace std::chrono;
+        json record = {
+            {"op", "start"},
+            {"seq", seq},
+            {"time", duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count()},
+            {"session", session},
+            {"id", id},
+            {"tool", tool},
+            {"arguments", arguments}
+        };
+        uint64_t written = append(record.dump() + "\n");
+        if (wait_for_sync_) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            synced_cv_.wait(lock, [this, written] { return synced_ >= written || stopping_; });
+        }
+        return seq;
+    }
+    
+    /**
+     * @brief Record how a started call ended ("ok", "error", "cancelled")
+     */
+    void complete(uint64_t seq, const char* status) {
+        char line[96];
+        std::snprintf(line, sizeof(line), "{\"op\":\"end\",\"seq\":%llu,\"status\":\"%s\"}\n",
+                      static_cast<unsigned long long>(seq), status);
+        append(line);
+    }
+    
+    /**
+     * @brief Start records without a matching end record in an existing journal
+     * 
+     * A torn last line from a crash is skipped.
+     */
+    static std::vector<json> recover(const std::string& path) {
+        std::ifstream in(path);
+        std::unordered_map<uint64_t, json> open_calls;
+        std::string line;
+        while (std::getline(in, line)) {
+            json record = json::parse(line, nullptr, false);
+            if (record.is_discarded() || !record.is_object()) {
+                continue;
+            }
+            uint64_t seq = record.value("seq", uint64_t{0});
+            if (record.value("op", "") == "start") {
+                open_calls[seq] = std::move(record);
+            } else {
+                open_calls.erase(seq);
+            }
+        }
+        
+        std::vector<json> incomplete;
+        for (auto& [seq, record] : open_calls) {
+            incomplete.push_back(std::move(record));
+        }
+        std::sort(incomplete.begin(), incomplete.end(), [](const json& a, const json& b) {
+            return a["seq"].get<uint64_t>() < b["seq"].get<uint64_t>();
+        });
+        return incomplete;
+    }
+    
+private:
+    /**
+     * @brief Write one record to the file; returns its number for the sync thread
+     */
+    uint64_t append(const std::string& record) {
+        std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+#if defined(__unix__) || defined(__APPLE__)
+        // O_APPEND makes each write() land whole at the end without a lock
+        const char* data = record.data();
+        size_t left = record.size();
+        while (left > 0) {
+            ssize_t n = ::write(fd_, data, left);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                std::cerr << "Journal write failed: " << std::strerror(errno) << std::endl;
+                break;
+            }
+            data += n;
+            left -= static_cast<size_t>(n);
+        }
+        lock.lock();
+#else
+        lock.lock();
+        if (std::fwrite(record.data(), 1, record.size(), file_) != record.size() || std::fflush(file_) != 0) {
+            std::cerr << "Journal write failed: " << std::strerror(errno) << std::endl;
+        }
+#endif
+        uint64_t written = ++written_;
+        lock.unlock();
+        if (sync_interval_.count() == 0) {
+            cv_.notify_one();
+        }
+        return written;
+    }
+    
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            if (sync_interval_.count() == 0) {
+                cv_.wait(lock, [this] { return stopping_ || written_ != synced_; });
+            } else {
+                cv_.wait_for(lock, sync_interval_, [this] { return stopping_; });
+            }
+            bool stopping = stopping_;
+            uint64_t target = written_;
+            
+            if (target != synced_) {
+                lock.unlock();
+#if defined(__linux__)
+                ::fdatasync(fd_);
+#elif defined(__unix__) || defined(__APPLE__)
+                ::fsync(fd_);
+#endif
+                lock.lock();
+                synced_ = target;
+                synced_cv_.notify_all();
+            }
+            
+            if (stopping && written_ == synced_) {
+                return;
+            }
+        }
+    }
+    
+    std::chrono::milliseconds sync_interval_;
+    bool wait_for_sync_;
+#if defined(__unix__) || defined(__APPLE__)
+    int fd_ = -1;
+#else
+    std::FILE* file_ = nullptr;
+#endif
+    std::atomic<uint64_t> next_seq_{1};
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::condition_variable synced_cv_;
+    uint64_t written_ = 0;   // records written to the file
+    uint64_t synced_ = 0;    // records covered by the last sync
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+// ============================================================================
+// Paged Results
+// ============================================================================
+
+/**
+ * @brief Hex string of `bytes` random bytes from the OS generator
+ * 
+ * For IDs that grant access to something, where a seeded PRNG would let a
+ * client predict the IDs handed to others from the ones it has seen.
+ */
+inline std::string random_hex(size_t bytes) {
+    static thread_local std::random_device device;
+    static const char kDigits[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(bytes * 2);
+    while (hex.size() < bytes * 2) {
+        uint32_t word = device();
+        for (int i = 0; i < 8 && hex.size() < bytes * 2; ++i, word >>= 4) {
+            hex.push_back(kDigits[word & 0xF]);
+        }
+    }
+    return hex;
+}
+
+/**
+ * @brief Compare a secret with a candidate in time independent of where they differ
+ */
+inline bool secret_equals(std::string_view secret, std::string_view candidate) {
+    if (secret.empty() || secret.size() != candidate.size()) {
+        return false;
+    }
+    unsigned char diff = 0;
+    for (size_t i = 0; i < secret.size(); ++i) {
+        diff |= static_cast<unsigned char>(secret[i] ^ candidate[i]);
+    }
+    return diff == 0;
+}
+
+/**
+ * @brief Position in a buffered result: content item and byte offset into it
+ * 
+ * Sent to clients as "<result id>:<item>:<offset>". The cursor carries the
+ * whole position, so fetching the same cursor twice returns the same page.
+ */
+struct ResultCursor {
+    std::string result_id;
+    size_t item = 0;
+    uint64_t offset = 0;
+    
+    std::string str() const {
+        return result_id + ":" + std::to_string(item) + ":" + std::to_string(offset);
+    }
+    
+    static bool parse(const std::string& text, ResultCursor& cursor) {
+        size_t first = text.find(':');
+        size_t second = first == std::string::npos ? std::string::npos : text.find(':', first + 1);
+        if (second == std::string::npos) {
+            return false;
+        }
+        if (second == first + 1) {
+            return false;
+        }
+        char* end = nullptr;
+        cursor.result_id = text.substr(0, first);
+        cursor.item = std::strtoull(text.c_str() + first + 1, &end, 10);
+        if (end != text.c_str() + second) {
+            return false;
+        }
+        cursor.offset = std::strtoull(text.c_str() + second + 1, &end, 10);
+        return end == text.c_str() + text.size() && second + 1 < text.size();
+    }
+};
+
+/**
+ * @brief Finished tool results kept for clients that read them a page at a time
+ * 
+ * A tools/call that asks for pages gets the first page and a cursor, and
+ * the rest of the result waits here until the client fetches it with
+ * tools/result/next or tools/result/read. A result not read for ttl is
+ * dropped by a background thread. When capacity results are buffered, the
+ * least recently read one makes room. Spooled text stays in its temporary
+ * file, so a buffered result costs little memory.
+ * 
+ * Each result belongs to the session (or shared-memory channel) that made
+ * the call, and only that owner can read it; IDs are 128 random bits from
+ * the OS generator. Calls without a session share the empty owner, so for
+ * them the unguessable ID is the only protection.
+ */
+class ResultBuffer {
+public:
+    static constexpr size_t kDefaultPageSize = 64 << 10;
+    static constexpr size_t kMaxPageSize = 16 << 20;
+    
+    ResultBuffer(std::chrono::seconds ttl, size_t capacity)
+        : ttl_(ttl), capacity_(std::max<size_t>(1, capacity)) {
+        thread_ = std::thread([this] { run(); });
+    }
+    
+    ~ResultBuffer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        thread_.join();
+    }
+    
+    ResultBuffer(const ResultBuffer&) = delete;
+    ResultBuffer& operator=(const ResultBuffer&) = delete;
+    
+    /**
+     * @brief Keep a result for owner; returns the ID to fetch it by
+     */
+    std::string put(std::shared_ptr<const ToolResultWriter> result, size_t page_size, const std::string& owner) {
+        std::string id = random_hex(16);
+        
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (entries_.size() >= capacity_) {
+            auto oldest = std::min_element(entries_.begin(), entries_.end(), [](const auto& a, const auto& b) {
+                return a.second.last_read < b.second.last_read;
+            });
+            entries_.erase(oldest);
+        }
+        entries_[id] = Entry{std::move(result), page_size, Clock::now(), owner};
+        return id;
+    }
+    
+    /**
+     * @brief Look up owner's result, restarting its TTL; nullptr if unknown, expired or not owner's
+     * @param page_size Receives the page size the result was requested with
+     */
+    std::shared_ptr<const ToolResultWriter> get(const std::string& id, const std::string& owner,
+                                                size_t* page_size = nullptr) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(id);
+        if (it == entries_.end() || it->second.owner != owner) {
+            return nullptr;
+        }
+        it->second.last_read = Clock::now();
+        if (page_size) {
+            *page_size = it->second.page_size;
+        }
+        return it->second.result;
+    }
+    
+    /**
+     * @brief Result object holding the page at cursor; advances cursor past it
+     * 
+     * Text is cut on character boundaries, so a page may come out a few bytes
+     * short of page_size (or over, if one character is larger). Other content
+     * items count with their JSON size and are never split.
+     */
+    static json page(const ToolResultWriter& result, ResultCursor& cursor, size_t page_size) {
+        json content = json::array();
+        size_t budget = page_size;
+        if (cursor.item < result.itemCount() && result.isText(cursor.item)) {
+            cursor.offset = char_start(result, cursor.item, std::min(cursor.offset, result.textSize(cursor.item)));
+        }
+        
+        while (cursor.item < result.itemCount()) {
+            size_t i = cursor.item;
+            if (!result.isText(i)) {
+                size_t cost = result.block(i).dump().size();
+                if (cost > budget && !content.empty()) {
+                    break;
+                }
+                content.push_back(result.block(i));
+                budget -= std::min(cost, budget);
+                cursor.item++;
+                cursor.offset = 0;
+                continue;
+            }
+            
+            uint64_t remaining = result.textSize(i) - cursor.offset;
+            if (remaining <= budget) {
+                content.push_back({{"type", "text"}, {"text", result.readText(i, cursor.offset, remaining)}});
+                budget -= remaining;
+                cursor.item++;
+                cursor.offset = 0;
+                continue;
+            }
+            
+            std::string text = result.readText(i, cursor.offset, std::max<size_t>(budget, 4) + 1);
+            size_t cut = utf8_floor(text, budget);
+            if (cut == 0) {
+                if (!content.empty()) {
+                    break;
+                }
+                cut = 1;
+                while (cut < text.size() && (static_cast<unsigned char>(text[cut]) & 0xC0) == 0x80) {
+                    cut++;
+                }
+            }
+            text.resize(cut);
+            cursor.offset += cut;
+            content.push_back({{"type", "text"}, {"text", std::move(text)}});
+            break;
+        }
+        
+        json page = {{"content", std::move(content)}};
+        if (result.isError()) {
+            page["isError"] = true;
+        }
+        json meta = {{"resultId", cursor.result_id}, {"totalBytes", text_bytes(result)}};
+        if (cursor.item < result.itemCount()) {
+            meta["nextCursor"] = cursor.str();
+        }
+        page["_meta"] = std::move(meta);
+        return page;
+    }
+    
+    /**
+     * @brief Bytes [offset, offset + length) of a text item, moved back to character boundaries
+     * @param offset Receives where the returned text starts
+     */
+    static std::string range(const ToolResultWriter& result, size_t item, uint64_t& offset, size_t length) {
+        uint64_t size = result.textSize(item);
+        uint64_t end = std::min(size, offset + std::min<uint64_t>(length, size));
+        offset = char_start(result, item, std::min(offset, size));
+        end = std::max(offset, char_start(result, item, end));
+        return result.readText(item, offset, static_cast<size_t>(end - offset));
+    }
+    
+    /**
+     * @brief What a result adds up to when paged: text bytes plus other items' JSON size
+     */
+    static uint64_t pagedSize(const ToolResultWriter& result) {
+        uint64_t size = 0;
+        for (size_t i = 0; i < result.itemCount(); ++i) {
+            size += result.isText(i) ? result.textSize(i) : result.block(i).dump().size();
+        }
+        return size;
+    }
+    
+    /**
+     * @brief tools/result/next: the page at params.cursor, at params.pageSize or the original size
+     * @throws std::invalid_argument for a bad cursor or a result that is gone
+     */
+    json next(const json& params, const std::string& owner) {
+        ResultCursor cursor;
+        if (!params.contains("cursor") || !params["cursor"].is_string() ||
+            !ResultCursor::parse(params["cursor"].get<std::string>(), cursor)) {
+            throw std::invalid_argument("Invalid cursor");
+        }
+        size_t page_size = 0;
+        auto result = get(cursor.result_id, owner, &page_size);
+        if (!result) {
+            throw std::invalid_argument("Unknown or expired result");
+        }
+        if (cursor.item >= result->itemCount()) {
+            throw std::invalid_argument("Invalid cursor");
+        }
+        if (params.contains("pageSize") && params["pageSize"].is_number_unsigned()) {
+            page_size = std::clamp<size_t>(params["pageSize"].get<size_t>(), 1, ResultBuffer::kMaxPageSize);
+        }
+        return ResultBuffer::page(*result, cursor, page_size);
+    }
+    
+    /**
+     * @brief tools/result/read: params.length bytes of text item params.item from params.offset
+     * @throws std::invalid_argument if the result is gone or the item is not text
+     */
+    json read(const json& params, const std::string& owner) {
+        std::string id = params.value("resultId", "");
+        auto result = get(id, owner);
+        if (!result) {
+            throw std::invalid_argument("Unknown or expired result");
+        }
+        size_t item = params.value("item", size_t{0});
+        if (item >= result->itemCount() || !result->isText(item)) {
+            throw std::invalid_argument("Content item " + std::to_string(item) + " is not text");
+        }
+        uint64_t offset = params.value("offset", uint64_t{0});
+        size_t length = std::min(params.value("length", ResultBuffer::kDefaultPageSize), ResultBuffer::kMaxPageSize);
+        std::string text = ResultBuffer::range(*result, item, offset, length);
+        
+        json meta = {
+            {"resultId", id},
+            {"item", item},
+            {"offset", offset},
+            {"length", text.size()},
+            {"totalBytes", result->textSize(item)}
+        };
+        return {
+            {"content", json::array({{{"type", "text"}, {"text", std::move(text)}}})},
+            {"_meta", std::move(meta)}
+        };
+    }
+    
+private:
+    struct Entry {
+        std::shared_ptr<const ToolResultWriter> result;
+        size_t page_size;
+        Clock::time_point last_read;
+        std::string owner;      // session ID or channel token of the caller
+    };
+    
+    static uint64_t text_bytes(const ToolResultWriter& result) {
+        uint64_t size = 0;
+        for (size_t i = 0; i < result.itemCount(); ++i) {
+            if (result.isText(i)) {
+                size += result.textSize(i);
+            }
+        }
+        return size;
+    }
+    
+    static uint64_t char_start(const ToolResultWriter& result, size_t item, uint64_t offset) {
+        uint64_t lead = std::min<uint64_t>(offset, 3);
+        std::string bytes = result.readText(item, offset - lead, static_cast<size_t>(lead) + 1);
+        return offset - lead + utf8_floor(bytes, static_cast<size_t>(lead));
+    }
+    
+    void run() {
+        auto interval = std::clamp<std::chrono::seconds>(ttl_ / 4, std::chrono::seconds(1), std::chrono::seconds(30));
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!cv_.wait_for(lock, interval, [this] { return stopping_; })) {
+            // Destroy expired results (closing their temporary files) outside the lock
+            std::vector<std::shared_ptr<const ToolResultWriter>> expired;
+            Clock::time_point now = Clock::now();
+            for (auto it = entries_.begin(); it != entries_.end();) {
+                if (now - it->second.last_read >= ttl_) {
+                    expired.push_back(std::move(it->second.result));
+                    it = entries_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            lock.unlock();
+            expired.clear();
+            lock.lock();
+        }
+    }
+    
+    std::chrono::seconds ttl_;
+    size_t capacity_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::unordered_map<std::string, Entry> entries_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+// ============================================================================
+// Shards (thread-per-core)
+// ============================================================================
+
+/**
+ * @brief Bounded lock-free single-producer/single-consumer ring
+ * 
+ * Producer and consumer each keep a cached copy of the other side's index,
+ * so in the common case neither touches the other's cache line.
+ */
+template<typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        mask_ = size - 1;
+        slots_.resize(size);
+    }
+    
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+    
+    /**
+     * @brief Enqueue an item (producer only)
+     * @return false if the ring is full; item is left untouched
+     */
+    bool push(T&& item) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_cache_ > mask_) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head - tail_cache_ > mask_) {
+                return false;
+            }
+        }
+        slots_[head & mask_] = std::move(item);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+    
+    /**
+     * @brief Dequeue an item (consumer only)
+     */
+    bool pop(T& item) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_cache_) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail == head_cache_) {
+                return false;
+            }
+        }
+        item = std::move(slots_[tail & mask_]);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+    
+private:
+    alignas(64) std::atomic<size_t> head_{0};
+    size_t tail_cache_ = 0;
+    alignas(64) std::atomic<size_t> tail_{0};
+    size_t head_cache_ = 0;
+    alignas(64) size_t mask_ = 0;
+    std::vector<T> slots_;
+};
+
+class MCPSession;
+
+/**
+ * @brief Per-shard request counters (only ever touched by the owning shard)
+ */
+struct ShardCounters {
+    uint64_t connections = 0;
+    uint64_t requests = 0;
+    uint64_t tool_calls = 0;
+    uint64_t unrouted = 0;              // requests answered with 404
+    std::vector<uint64_t> routes;       // requests per route, by route index
+};
+
+/**
+ * @brief A serialized SSE event kept for replay
+ */
+struct SseEvent {
+    uint64_t id = 0;
+    std::shared_ptr<const std::string> head;    // "id: N\n", shared by a shard's copies of an event
+    std::shared_ptr<const std::string> body;    // "data: ...\n\n", shared by every copy
+};
+
+/**
+ * @brief Fixed-size ring of a session's most recent SSE events
+ * 
+ * Storage grows with the first events and is reused once the ring is full,
+ * so in steady state recording an event is a couple of reference-count
+ * updates and no allocation.
+ */
+class ReplayRing {
+public:
+    void push(const SseEvent& event, size_t capacity) {
+        if (capacity == 0) {
+            return;
+        }
+        if (slots_.size() < capacity) {
+            slots_.push_back(event);
+            return;
+        }
+        slots_[oldest_] = event;
+        oldest_ = (oldest_ + 1) % slots_.size();
+    }
+    
+    size_t size() const { return slots_.size(); }
+    
+    /**
+     * @brief Visit the kept events, oldest first
+     */
+    template<typename Fn>
+    void forEach(Fn&& fn) const {
+        for (size_t i = 0; i < slots_.size(); ++i) {
+            fn(slots_[(oldest_ + i) % slots_.size()]);
+        }
+    }
+    
+private:
+    std::vector<SseEvent> slots_;
+    size_t oldest_ = 0;     // only moves once slots_ is full
+};
+
+/**
+ * @brief Entry in a shard's session table
+ * 
+ * The entry outlives its SSE connection so a client can reconnect with
+ * Last-Event-ID and get the events it missed; idle entries without a
+ * stream are reaped after ServerConfig::session_linger.
+ */
+struct SessionInfo {
+    std::weak_ptr<MCPSession> stream;   // open SSE connection, if any
+    size_t stream_shard = 0;            // shard whose thread owns the stream's socket
+    uint64_t messages = 0;              // POSTs addressed to this session
+    uint64_t last_event_id = 0;
+    ReplayRing replay;
+    std::string resume_token;           // issued with the first stream; required to reattach
+    // From initialize; persisted so a client can skip it after a restart
+    std::string protocol_version;
+    json client_capabilities;
+    json client_info;
+    Clock::time_point last_seen = Clock::now();
+};
+
+/**
+ * @brief A shard's copy of the tools/list payload at one registry epoch
+ */
+struct ToolsListSnapshot {
+    uint64_t epoch = 0;
+    json tools;                                 // array of tool schemas
+    std::shared_ptr<const std::string> body;    // serialized {"tools": [...]}, for GET /tools
+    // Combines the epoch with a hash of the body, so tags stay distinct
+    // across restarts with a different set of tools
+    std::string etag;
+};
+
+/**
+ * @brief One thread's copy of the tool registry and its tools/list payload
+ * 
+ * Rebuilt whenever the registry epoch moves, so the shared registry is
+ * only read on changes rather than on every request. Not thread-safe:
+ * each shard and each shared-memory channel keeps its own.
+ */
+class ToolCatalog {
+public:
+    /**
+     * @brief The current payload; take the epoch, tag and tools from this one snapshot
+     */
+    std::shared_ptr<const ToolsListSnapshot> list() {
+        refresh();
+        return list_;
+    }
+    
+    std::shared_ptr<Tool> find(const std::string& name) {
+        refresh();
+        auto it = tools_.find(name);
+        return it != tools_.end() ? it->second : nullptr;
+    }
+    
+private:
+    void refresh() {
+        uint64_t epoch = ToolRegistry::instance().epoch();
+        if (list_ && epoch == list_->epoch) {
+            return;
+        }
+        // The snapshot and its epoch are taken together; a change racing with
+        // this refresh just triggers another one on the next call
+        tools_ = ToolRegistry::instance().getAllTools(&epoch);
+        auto list = std::make_shared<ToolsListSnapshot>();
+        list->epoch = epoch;
+        list->tools = json::array();
+        for (const auto& [name, tool] : tools_) {
+            list->tools.push_back(tool->getSchema());
+        }
+        list->body = std::make_shared<const std::string>(json{{"tools", list->tools}}.dump());
+        
+        char etag[48];
+        std::snprintf(etag, sizeof(etag), "\"%llx-%016zx\"", static_cast<unsigned long long>(epoch),
+                      std::hash<std::string>{}(*list->body));
+        list->etag = etag;
+        list_ = std::move(list);
+    }
+    
+    std::unordered_map<std::string, std::shared_ptr<Tool>> tools_;
+    std::shared_ptr<const ToolsListSnapshot> list_;
+};
+
+class ShardSet;
+
+/**
+ * @brief One io thread and the state it owns exclusively
+ * 
+ * Sessions, caches and counters live in exactly one shard and are only
+ * accessed from that shard's thread. Other shards reach them by sending a
+ * message through ShardSet::run_on(), never by sharing memory.
+ */
+class Shard {
+public:
+    Shard(ShardSet& set, size_t index, size_t count) : set_(set), index_(index) {
+        for (size_t i = 0; i < count; ++i) {
+            inbound_.push_back(std::make_unique<SpscQueue<std::function<void()>>>(kQueueCapacity));
+        }
+        overflow_.resize(count);
+    }
+    
+    Shard(const Shard&) = delete;
+    Shard& operator=(const Shard&) = delete;
+    
+    /**
+     * @brief The shard whose thread is calling, or nullptr
+     */
+    static Shard* current() { return current_; }
+    
+    size_t index() const { return index_; }
+    ShardSet& set() { return set_; }
+    asio::io_context& context() { return context_; }
+    ShardCounters& counters() { return counters_; }
+    
+    /**
+     * @brief Sessions owned by this shard, keyed by session ID
+     */
+    std::unordered_map<std::string, SessionInfo>& sessions() { return sessions_; }
+    
+    /**
+     * @brief Send a JSON-RPC message on a session's SSE stream
+     * 
+     * Must run on this shard's thread, and the session must be owned by this
+     * shard. The message is serialized once, numbered, kept in the session's
+     * replay buffer and handed to the stream's shard if a stream is open.
+     * @return The event ID, or 0 if there is no such session
+     */
+    uint64_t publish(const std::string& session_id, const json& message);
+    
+    /**
+     * @brief Deliver an already serialized "data: ...\n\n" body to every session of this shard
+     * 
+     * Takes one event ID and allocates one "id:" line for the whole shard;
+     * each session only gets references pushed onto its replay buffer and
+     * stream queue. Use ShardSet::broadcast() to reach all shards.
+     */
+    void broadcast(std::shared_ptr<const std::string> body);
+    
+    /**
+     * @brief Periodically drop sessions whose stream has been gone for longer than linger
+     */
+    void start_reaper(std::chrono::seconds linger, size_t replay_events);
+    
+    /**
+     * @brief Snapshot the session table to the store whenever it changed (once a second at most)
+     */
+    void start_persistence(SessionStore& store);
+    
+    /**
+     * @brief Note a change to the persisted part of the session table
+     */
+    void markSessionsChanged() { ++sessions_version_; }
+    
+    /**
+     * @brief Recreate a session from a stored record (before the shards start)
+     */
+    void restore(const json& record);
+    
+    /**
+     * @brief Replay buffer length per session
+     */
+    size_t replayCapacity() const { return replay_capacity_; }
+    
+    /**
+     * @brief This shard's copy of the tool registry
+     */
+    ToolCatalog& tools() { return tools_; }
+    
+private:
+    friend class ShardSet;
+    static constexpr size_t kQueueCapacity = 1024;
+    static constexpr uint64_t kEventIdReserve = uint64_t(1) << 20;
+    
+    void schedule_drain() {
+        if (!drain_scheduled_.exchange(true, std::memory_order_acq_rel)) {
+            asio::post(context_, [this] { drain(); });
+        }
+    }
+    
+    void drain() {
+        // Clear the flag first so pushes racing with this drain schedule another one.
+        // An RMW, not a store: a plain store could be reordered after the pops' loads
+        // and miss a push whose producer still saw the flag set.
+        drain_scheduled_.exchange(false, std::memory_order_acq_rel);
+        std::function<void()> fn;
+        for (auto& queue : inbound_) {
+            while (queue->pop(fn)) {
+                fn();
+            }
+        }
+    }
+    
+    /**
+     * @brief Send fn to another shard through this shard's queue to it
+     * 
+     * When the queue is full, messages wait in an ordered overflow list on
+     * this shard and are moved into the queue as it drains, so messages from
+     * one shard always arrive in the order they were sent.
+     */
+    void send(Shard& to, std::function<void()> fn) {
+        auto& pending = overflow_[to.index()];
+        if (pending.empty() && to.inbound_[index_]->push(std::move(fn))) {
+            to.schedule_drain();
+            return;
+        }
+        pending.push_back(std::move(fn));
+        if (pending.size() == 1) {
+            asio::post(context_, [this, &to] { flush(to); });
+        }
+    }
+    
+    void flush(Shard& to) {
+        auto& pending = overflow_[to.index()];
+        auto& queue = *to.inbound_[index_];
+        while (!pending.empty() && queue.push(std::move(pending.front()))) {
+            pending.pop_front();
+        }
+        to.schedule_drain();
+        if (!pending.empty()) {
+            asio::post(context_, [this, &to] { flush(to); });
+        }
+    }
+    
+    static inline thread_local Shard* current_ = nullptr;
+    
+    ShardSet& set_;
+    size_t index_;
+    asio::io_context context_{1};
+    // inbound_[i] carries messages sent by shard i
+    std::vector<std::unique_ptr<SpscQueue<std::function<void()>>>> inbound_;
+    std::atomic<bool> drain_scheduled_{false};
+    // overflow_[i] holds messages for shard i that found its queue full, oldest first
+    std::vector<std::deque<std::function<void()>>> overflow_;
+    ShardCounters counters_;
+    std::unordered_map<std::string, SessionInfo> sessions_;
+    void reap(std::chrono::seconds linger);
+    // Streams on other shards, by shard, to reach with one message each
+    using RemoteStreams = std::vector<std::vector<std::weak_ptr<MCPSession>>>;
+    void deliver(SessionInfo& info, const SseEvent& event, RemoteStreams* remote = nullptr);
+    SseEvent make_event(std::shared_ptr<const std::string> body);
+    void persist(SessionStore& store);
+    
+    std::unique_ptr<asio::steady_timer> reaper_;
+    size_t replay_capacity_ = 256;
+    // SSE event IDs; shard-wide so a broadcast gets one ID on every session
+    // here, and monotonic per session because sessions never change owner
+    uint64_t event_seq_ = 0;
+    std::unique_ptr<asio::steady_timer> persist_timer_;
+    uint64_t sessions_version_ = 0;
+    uint64_t persisted_version_ = 0;
+    // Event IDs up to here are covered by the last snapshot (see persist())
+    uint64_t event_ids_reserved_ = 0;
+    ToolCatalog tools_;
+};
+
+/**
+ * @brief The set of shards making up the server
+ * 
+ * In the default mode there is a single shard running on the main thread.
+ * With --thread-per-core (or --shards=N) every shard gets its own io thread,
+ * optionally pinned to one CPU, and the shards talk to each other only
+ * through per-pair SPSC queues.
+ */
+class ShardSet {
+public:
+    explicit ShardSet(size_t count) {
+        count = std::max<size_t>(count, 1);
+        for (size_t i = 0; i < count; ++i) {
+            shards_.push_back(std::make_unique<Shard>(*this, i, count));
+        }
+    }
+    
+    size_t size() const { return shards_.size(); }
+    Shard& operator[](size_t index) { return *shards_[index]; }
+    
+    /**
+     * @brief Log state of the sessions that called logging/setLevel
+     */
+    SessionLogs& logs() { return logs_; }
+    
+    /**
+     * @brief Tool state of every registered session
+     */
+    SessionStates& states() { return states_; }
+    
+    /**
+     * @brief Run fn on the thread of the target shard
+     * 
+     * From another shard's thread the message goes through that pair's SPSC
+     * queue (see Shard::send), so it keeps its order relative to the other
+     * messages from that shard; from any other thread (tool workers,
+     * startup) it is posted to the target's io_context. On the target's own
+     * thread fn runs inline.
+     */
+    void run_on(size_t target, std::function<void()> fn) {
+        Shard& to = *shards_[target];
+        Shard* from = Shard::current();
+        
+        if (from && &from->set() == this) {
+            if (from == &to) {
+                fn();
+            } else {
+                from->send(to, std::move(fn));
+            }
+            return;
+        }
+        asio::post(to.context(), std::move(fn));
+    }
+    
+    /**
+     * @brief Send a JSON-RPC notification to every session on every shard
+     * 
+     * The message is serialized once, here; each shard then fans the shared
+     * buffer out to its own sessions on its own thread.
+     */
+    void broadcast(const json& message) {
+        auto body = std::make_shared<const std::string>("data: " + message.dump() + "\n\n");
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            run_on(i, [this, i, body]() {
+                shards_[i]->broadcast(body);
+            });
+        }
+    }
+    
+    /**
+     * @brief Create a session ID owned by the given shard
+     * 
+     * The first four hex digits encode the owning shard.
+     */
+    std::string new_session_id(size_t shard) const {
+        char prefix[5];
+        std::snprintf(prefix, sizeof(prefix), "%04zx", shard);
+        return prefix + random_hex(14);
+    }
+    
+    /**
+     * @brief Shard owning a session ID (SIZE_MAX if the ID is malformed)
+     */
+    size_t owner_of(const std::string& session_id) const {
+        if (session_id.size() != 32) {
+            return SIZE_MAX;
+        }
+        size_t shard = std::strtoul(session_id.substr(0, 4).c_str(), nullptr, 16);
+        return shard < shards_.size() ? shard : SIZE_MAX;
+    }
+    
+    /**
+     * @brief Run every shard, shard 0 on the calling thread; never returns normally
+     * 
+     * Shard i is pinned to io_cpus[i % size]. In low-latency mode each shard
+     * spins on poll() instead of blocking in run(), and with rt_priority set
+     * it runs in the SCHED_FIFO class.
+     */
+    void run(const ServerConfig& config, SessionStore* store = nullptr) {
+        store_ = store;
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < shards_.size(); ++i) {
+            threads.emplace_back([this, i, &config] { run_shard(i, config); });
+        }
+        run_shard(0, config);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    
+private:
+    void run_shard(size_t index, const ServerConfig& config) {
+        Shard& shard = *shards_[index];
+        Shard::current_ = &shard;
+        place_current_thread(config.io_cpus, index, "io shard");
+        if (config.rt_priority > 0 && !set_realtime_priority(config.rt_priority)) {
+            std::cerr << "Could not give io shard " << index << " SCHED_FIFO priority "
+                      << config.rt_priority << std::endl;
+        }
+        
+        shard.start_reaper(config.session_linger, config.replay_events);
+        if (store_) {
+            shard.start_persistence(*store_);
+        }
+        auto guard = asio::make_work_guard(shard.context());
+        if (!config.low_latency) {
+            shard.context().run();
+            return;
+        }
+        
+        prefault_stack();
+        BufferPool::local().reserve(BufferPool::kPrefaultBlocks);
+        while (!shard.context().stopped()) {
+            if (shard.context().poll() == 0) {
+                cpu_relax();
+            }
+        }
+    }
+    
+    std::vector<std::unique_ptr<Shard>> shards_;
+    SessionStore* store_ = nullptr;
+    SessionLogs logs_;
+    SessionStates states_;
+};
+
+inline void Shard::start_persistence(SessionStore& store) {
+    persist_timer_ = std::make_unique<asio::steady_timer>(context_);
+    persist(store);
+}
+
+/**
+ * Events do not mark the table changed one by one. Each snapshot reserves
+ * the next kEventIdReserve IDs (restore() skips past them), and only an
+ * event beyond the reservation forces a new snapshot, so a busy stream
+ * does not rewrite the whole table every second.
+ */
+inline void Shard::persist(SessionStore& store) {
+    if (sessions_version_ != persisted_version_) {
+        json snapshot = json::array();
+        for (const auto& [id, info] : sessions_) {
+            snapshot.push_back({
+                {"id", id},
+                {"protocolVersion", info.protocol_version},
+                {"capabilities", info.client_capabilities},
+                {"clientInfo", info.client_info},
+                {"lastEventId", info.last_event_id},
+                {"resumeToken", info.resume_token}
+            });
+        }
+        store.save(index_, json::to_cbor(snapshot));
+        persisted_version_ = sessions_version_;
+        event_ids_reserved_ = event_seq_ + kEventIdReserve;
+    }
+    
+    persist_timer_->expires_after(std::chrono::seconds(1));
+    persist_timer_->async_wait([this, &store](std::error_code ec) {
+        if (!ec) {
+            persist(store);
+        }
+    });
+}
+
+inline void Shard::restore(const json& record) {
+    std::string id = record.at("id").get<std::string>();
+    SessionInfo& info = sessions_[id];
+    set_.states().attach(id);
+    info.protocol_version = record.value("protocolVersion", "");
+    info.client_capabilities = record.value("capabilities", json());
+    info.client_info = record.value("clientInfo", json());
+    info.last_event_id = record.value("lastEventId", uint64_t{0});
+    info.resume_token = record.value("resumeToken", "");
+    // Keep event IDs increasing across the restart, past any reserved after the snapshot
+    event_seq_ = std::max(event_seq_, info.last_event_id + kEventIdReserve);
+}
+
+inline void Shard::start_reaper(std::chrono::seconds linger, size_t replay_events) {
+    replay_capacity_ = replay_events;
+    reaper_ = std::make_unique<asio::steady_timer>(context_);
+    reap(linger);
+}
+
+inline void Shard::reap(std::chrono::seconds linger) {
+    Clock::time_point cutoff = Clock::now() - linger;
+    for (auto it = sessions_.begin(); it != sessions_.end();) {
+        if (it->second.stream.expired() && it->second.last_seen < cutoff) {
+            set_.logs().erase(it->first);
+            set_.states().erase(it->first);
+            it = sessions_.erase(it);
+            markSessionsChanged();
+        } else {
+            ++it;
+        }
+    }
+    
+    reaper_->expires_after(std::clamp<Clock::duration>(linger, std::chrono::seconds(1), std::chrono::seconds(30)));
+    reaper_->async_wait([this, linger](std::error_code ec) {
+        if (!ec) {
+            reap(linger);
+        }
+    });
+}
+
+/**
+ * @brief Check an If-None-Match header value against an entity tag
+ * 
+ * Accepts "*" and comma-separated lists; weak tags (W/"...") compare equal
+ * to their strong form, as RFC 9110 requires for If-None-Match.
+ */
+inline bool etag_matches(std::string_view if_none_match, std::string_view etag) {
+    while (!if_none_match.empty()) {
+        size_t comma = std::min(if_none_match.find(','), if_none_match.size());
+        std::string_view candidate = if_none_match.substr(0, comma);
+        if_none_match.remove_prefix(std::min(comma + 1, if_none_match.size()));
+        
+        while (!candidate.empty() && candidate.front() == ' ') {
+            candidate.remove_prefix(1);
+        }
+        while (!candidate.empty() && candidate.back() == ' ') {
+            candidate.remove_suffix(1);
+        }
+        if (candidate.substr(0, 2) == "W/") {
+            candidate.remove_prefix(2);
+        }
+        if (candidate == "*" || candidate == etag) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Everything a session needs from the server, bundled by reference
+ */
+struct ServerContext {
+    const ServerConfig& config;
+    ToolExecutor& executor;
+    ShardSet& shards;
+    RequestJournal* journal = nullptr;
+    ResultBuffer* results = nullptr;
+};
+
+// ============================================================================
+// JSON-RPC Dispatch
+// ============================================================================
+
+/**
+ * @brief The MCP methods, shared by the HTTP and shared-memory transports
+ * 
+ * dispatch() checks the JSON-RPC envelope and answers what only needs the
+ * tool catalog itself: initialize, tools/list and completion/complete.
+ * Tool calls, result paging and logging/setLevel are handed to the
+ * transport, which answers them once they finish. Deadlines are computed
+ * here as well, so a request times out the same way on either transport.
+ */
+class McpDispatcher {
+public:
+    /**
+     * @brief A tools/call request, checked and with its tool looked up
+     */
+    struct ToolCall {
+        std::string name;
+        std::shared_ptr<Tool> tool;
+        json arguments;
+        Clock::time_point deadline;
+        size_t page_size = 0;       // params._meta.pageSize; 0 sends the whole result
+    };
+    
+    explicit McpDispatcher(const ServerContext& server) : config_(server.config), results_(server.results) {}
+    virtual ~McpDispatcher() = default;
+    
+    /**
+     * @brief Handle one decoded request
+     * @param start When the request arrived; its timeout is measured from here
+     * @param header_timeout A timeout sent outside the message, e.g. X-Request-Timeout (0 = none)
+     * @return The response, or null if the transport sends it later
+     */
+    json dispatch(const json& request, Clock::time_point start, std::chrono::milliseconds header_timeout = {}) {
+        if (!request.is_object() || !request.contains("method") || !request["method"].is_string()) {
+            return create_error_response(request, -32600, "Invalid Request");
+        }
+        const std::string& method = request["method"].get_ref<const std::string&>();
+        try {
+            if (method == "initialize") {
+                on_initialize(request);
+                return result_response(request, initialize_result());
+            } else if (method == "tools/list") {
+                return result_response(request, tools_list_result(request, *catalog().list()));
+            } else if (method == "tools/call") {
+                const json& params = request.at("params");
+                ToolCall call;
+                call.name = params.at("name").get<std::string>();
+                call.tool = catalog().find(call.name);
+                if (!call.tool) {
+                    return create_error_response(request, -32602, "Unknown tool: " + call.name);
+                }
+                call.arguments = params.value("arguments", json::object());
+                call.deadline = request_deadline(request, start, header_timeout);
+                call.page_size = requested_page_size(request);
+                call_tool(request, std::move(call));
+                return json();
+            } else if (method == "logging/setLevel") {
+                LogLevel level;
+                json params = request.value("params", json::object());
+                if (!params.contains("level") || !params["level"].is_string() ||
+                    !parse_log_level(params["level"].get_ref<const std::string&>(), level)) {
+                    return create_error_response(request, -32602, "Invalid log level");
+                }
+                set_log_level(request, level);
+                return json();
+            } else if (method == "completion/complete") {
+                return complete(request);
+            } else if ((method == "tools/result/next" || method == "tools/result/read") && results_) {
+                fetch_result(request, method, request_deadline(request, start, header_timeout));
+                return json();
+            }
+            return create_error_response(request, -32601, "Method not found");
+        } catch (const std::invalid_argument& e) {
+            return create_error_response(request, -32602, e.what());
+        } catch (const json::exception& e) {
+            return create_error_response(request, -32602, std::string("Invalid params: ") + e.what());
+        }
+    }
+    
+    /**
+     * @brief Compute the absolute deadline of a request
+     * 
+     * The timeout is the shorter of header_timeout and params._meta.timeoutMs
+     * (milliseconds); when neither gives a positive one the server default
+     * applies. It is measured from start.
+     */
+    Clock::time_point request_deadline(const json& request, Clock::time_point start,
+                                       std::chrono::milliseconds header_timeout = {}) const {
+        std::chrono::milliseconds timeout = header_timeout;
+        const json* meta = request_meta(request);
+        if (meta && meta->contains("timeoutMs") && (*meta)["timeoutMs"].is_number()) {
+            std::chrono::milliseconds meta_timeout((*meta)["timeoutMs"].get<int64_t>());
+            if (meta_timeout.count() > 0 && (timeout.count() <= 0 || meta_timeout < timeout)) {
+                timeout = meta_timeout;
+            }
+        }
+        if (timeout.count() <= 0) {
+            timeout = config_.default_timeout;
+        }
+        if (timeout.count() <= 0) {
+            return Clock::time_point::max();
+        }
+        return start + timeout;
+    }
+    
+    static json result_response(const json& request, json result) {
+        json response = {
+            {"jsonrpc", "2.0"},
+            {"result", std::move(result)}
+        };
+        if (request.is_object() && request.contains("id")) {
+            response["id"] = request["id"];
+        }
+        return response;
+    }
+    
+    static json create_error_response(const json& request, int code, const std::string& message) {
+        json response = {
+            {"jsonrpc", "2.0"},
+            {"error", {
+                {"code", code},
+                {"message", message}
+            }}
+        };
+        
+        // Copy id if present, otherwise use null
+        if (request.is_object() && request.contains("id")) {
+            response["id"] = request["id"];
+        } else {
+            response["id"] = nullptr;
+        }
+        
+        return response;
+    }
+    
+protected:
+    /**
+     * @brief The transport's copy of the tool registry
+     */
+    virtual ToolCatalog& catalog() = 0;
+    
+    /**
+     * @brief Run a tool call and send its response
+     */
+    virtual void call_tool(const json& request, ToolCall call) = 0;
+    
+    /**
+     * @brief Start sending the client log records at or above level, then answer
+     */
+    virtual void set_log_level(const json& request, LogLevel level) = 0;
+    
+    /**
+     * @brief tools/result/next and tools/result/read against the result buffer
+     * 
+     * next takes {cursor, pageSize?} and returns the following page in the
+     * same shape as the tools/call result. read takes {resultId, item?,
+     * offset?, length?} and returns that byte range of one text item.
+     */
+    virtual void fetch_result(const json& request, const std::string& method, Clock::time_point deadline) = 0;
+    
+    /**
+     * @brief Called before initialize is answered, e.g. to store what the client sent
+     */
+    virtual void on_initialize(const json&) {}
+    
+    /**
+     * @brief Whether the transport sends notifications/tools/list_changed
+     */
+    virtual bool notifies_list_changed() const { return true; }
+    
+    const ServerConfig& config_;
+    ResultBuffer* results_;
+    
+private:
+    static const json* request_meta(const json& request) {
+        auto params = request.find("params");
+        if (params == request.end() || !params->is_object()) {
+            return nullptr;
+        }
+        auto meta = params->find("_meta");
+        return meta != params->end() && meta->is_object() ? &*meta : nullptr;
+    }
+    
+    /**
+     * @brief Page size asked for with params._meta.pageSize (0 = send the whole result)
+     */
+    size_t requested_page_size(const json& request) const {
+        const json* meta = request_meta(request);
+        if (!results_ || !meta || !meta->contains("pageSize") || !(*meta)["pageSize"].is_number_unsigned()) {
+            return 0;
+        }
+        return std::clamp<size_t>((*meta)["pageSize"].get<size_t>(), 1, ResultBuffer::kMaxPageSize);
+    }
+    
+    json initialize_result() const {
+        return {
+            {"protocolVersion", kProtocolVersion},
+            {"serverInfo", {
+                {"name", "CustomMCP"},
+                {"version", "1.0.0"}
+            }},
+            {"capabilities", {
+                {"tools", {{"listChanged", notifies_list_changed()}}},
+                {"completions", json::object()},
+                {"logging", json::object()}
+            }}
+        };
+    }
+    
+    /**
+     * @brief tools/list, honouring the params._meta.ifNoneMatch and since hints
+     * 
+     * Every result carries the payload's tag and registry epoch in _meta.
+     * A client that sends the tag it already holds gets
+     * {"_meta": {"notModified": true}} instead of the tool list. A client
+     * that sends the epoch it last saw as "since" gets only what changed
+     * after it in "delta", or the full list with "resync": true when the
+     * changelog no longer reaches back that far.
+     */
+    static json tools_list_result(const json& request, const ToolsListSnapshot& list) {
+        const std::string& etag = list.etag;
+        uint64_t epoch = list.epoch;
+        json meta = {{"etag", etag}, {"epoch", epoch}};
+        
+        if (const json* hints = request_meta(request)) {
+            auto match = hints->find("ifNoneMatch");
+            auto since = hints->find("since");
+            if (match != hints->end() && match->is_string() &&
+                etag_matches(match->get_ref<const std::string&>(), etag)) {
+                meta["notModified"] = true;
+                return {{"_meta", std::move(meta)}};
+            }
+            if (since != hints->end() && since->is_number_unsigned()) {
+                json delta;
+                if (ToolRegistry::instance().changesSince(since->get<uint64_t>(), delta)) {
+                    if (delta["epoch"] != epoch) {
+                        // The registry moved past this copy; its tag is stale
+                        meta.erase("etag");
+                        meta["epoch"] = delta["epoch"];
+                    }
+                    return {{"delta", std::move(delta)}, {"_meta", std::move(meta)}};
+                }
+                meta["resync"] = true;
+            }
+        }
+        return {{"tools", list.tools}, {"_meta", std::move(meta)}};
+    }
+    
+    /**
+     * @brief completion/complete for tool arguments
+     * 
+     * MCP only defines prompt and resource references; tools are referred
+     * to as {"type": "ref/tool", "name": ...}. Answered on the calling
+     * thread, since providers are in-memory indexes.
+     */
+    json complete(const json& request) {
+        static constexpr size_t kMaxCompletions = 100;   // limit set by the protocol
+        
+        json params = request.value("params", json::object());
+        json ref = params.value("ref", json::object());
+        json argument = params.value("argument", json::object());
+        if (ref.value("type", "") != "ref/tool") {
+            return create_error_response(request, -32602, "Unsupported completion reference: " + ref.value("type", ""));
+        }
+        std::string tool_name = ref.value("name", "");
+        auto tool = catalog().find(tool_name);
+        if (!tool) {
+            return create_error_response(request, -32602, "Unknown tool: " + tool_name);
+        }
+        
+        Completion completion;
+        auto provider = tool->getCompletionProvider(argument.value("name", ""));
+        if (provider) {
+            completion = provider->complete(argument.value("value", ""), kMaxCompletions);
+        }
+        
+        bool has_more = completion.total > completion.values.size();
+        return result_response(request, {
+            {"completion", {
+                {"values", std::move(completion.values)},
+                {"total", completion.total},
+                {"hasMore", has_more}
+            }}
+        });
+    }
+};
+
+// ============================================================================
+// HTTP Routing
+// ============================================================================
+
+enum class HttpMethod { Get, Post, Options, Other };
+
+constexpr size_t kRoutedMethods = 3;   // Get, Post, Options
+
+inline HttpMethod parse_http_method(std::string_view method) {
+    if (method == "GET") {
+        return HttpMethod::Get;
+    }
+    if (method == "POST") {
+        return HttpMethod::Post;
+    }
+    if (method == "OPTIONS") {
+        return HttpMethod::Options;
+    }
+    return HttpMethod::Other;
+}
+
+inline const char* http_method_name(HttpMethod method) {
+    switch (method) {
+        case HttpMethod::Get: return "GET";
+        case HttpMethod::Post: return "POST";
+        case HttpMethod::Options: return "OPTIONS";
+        default: return "OTHER";
+    }
+}
+
+/**
+ * @brief A parsed request line and header block
+ */
+struct HttpRequest {
+    HttpMethod method = HttpMethod::Other;
+    std::string path;
+    std::unordered_map<std::string, std::string> headers;
+    // Captured "{name}" segments; views into the route table and path
+    std::vector<std::pair<std::string_view, std::string_view>> params;
+    
+    std::string_view param(std::string_view name) const {
+        for (const auto& p : params) {
+            if (p.first == name) {
+                return p.second;
+            }
+        }
+        return {};
+    }
+};
+
+/**
+ * @brief Trie of path segments mapping (method, path) to handlers
+ * 
+ * Built once at startup and read-only afterwards, so every shard matches
+ * against the same table without locking. A segment written as "{name}"
+ * matches any single non-empty segment and is captured into
+ * HttpRequest::params; literal segments are tried before captures.
+ */
+template <typename Handler>
+class Router {
+public:
+    struct Route {
+        HttpMethod method;
+        std::string pattern;
+        Handler handler;
+    };
+    
+    /**
+     * @brief Register a handler; returns the route's index
+     */
+    size_t add(HttpMethod method, std::string_view pattern, Handler handler) {
+        if (method == HttpMethod::Other) {
+            throw std::invalid_argument("Unroutable method for " + std::string(pattern));
+        }
+        
+        Node* node = root_.get();
+        std::string_view rest = pattern;
+        while (!rest.empty()) {
+            if (rest.front() == '/') {
+                rest.remove_prefix(1);
+                continue;
+            }
+            size_t slash = std::min(rest.find('/'), rest.size());
+            std::string_view segment = rest.substr(0, slash);
+            rest.remove_prefix(slash);
+            
+            if (segment.size() > 2 && segment.front() == '{' && segment.back() == '}') {
+                if (!node->capture) {
+                    node->capture = std::make_unique<Node>();
+                    node->capture->segment = segment.substr(1, segment.size() - 2);
+                }
+                node = node->capture.get();
+                continue;
+            }
+            
+            auto it = std::find_if(node->children.begin(), node->children.end(),
+                [segment](const std::unique_ptr<Node>& child) { return child->segment == segment; });
+            if (it == node->children.end()) {
+                node->children.push_back(std::make_unique<Node>());
+                node->children.back()->segment = segment;
+                it = std::prev(node->children.end());
+            }
+            node = it->get();
+        }
+        
+        size_t& slot = node->routes[static_cast<size_t>(method)];
+        if (slot != SIZE_MAX) {
+            throw std::invalid_argument("Duplicate route " + std::string(http_method_name(method)) +
+                                        " " + std::string(pattern));
+        }
+        slot = routes_.size();
+        routes_.push_back(Route{method, std::string(pattern), std::move(handler)});
+        return slot;
+    }
+    
+    /**
+     * @brief Index of the route for a request (SIZE_MAX if none), filling in its params
+     */
+    size_t match(HttpRequest& request) const {
+        request.params.clear();
+        if (request.method == HttpMethod::Other) {
+            return SIZE_MAX;
+        }
+        const Node* node = find(root_.get(), request.path, request.params);
+        return node ? node->routes[static_cast<size_t>(request.method)] : SIZE_MAX;
+    }
+    
+    const std::vector<Route>& routes() const { return routes_; }
+    
+private:
+    struct Node {
+        std::string segment;                        // literal text, or capture name
+        std::vector<std::unique_ptr<Node>> children;
+        std::unique_ptr<Node> capture;
+        std::array<size_t, kRoutedMethods> routes;
+        
+        Node() { routes.fill(SIZE_MAX); }
+        
+        bool routed() const {
+            return std::any_of(routes.begin(), routes.end(), [](size_t r) { return r != SIZE_MAX; });
+        }
+    };
+    
+    static const Node* find(const Node* node, std::string_view rest,
+                            std::vector<std::pair<std::string_view, std::string_view>>& params) {
+        while (!rest.empty() && rest.front() == '/') {
+            rest.remove_prefix(1);
+        }
+        if (rest.empty()) {
+            return node->routed() ? node : nullptr;
+        }
+        
+        size_t slash = std::min(rest.find('/'), rest.size());
+        std::string_view segment = rest.substr(0, slash);
+        rest.remove_prefix(slash);
+        
+        for (const auto& child : node->children) {
+            if (child->segment == segment) {
+                if (const Node* found = find(child.get(), rest, params)) {
+                    return found;
+                }
+            }
+        }
+        if (node->capture) {
+            params.emplace_back(node->capture->segment, segment);
+            if (const Node* found = find(node->capture.get(), rest, params)) {
+                return found;
+            }
+            params.pop_back();
+        }
+        return nullptr;
+    }
+    
+    std::unique_ptr<Node> root_ = std::make_unique<Node>();
+    std::vector<Route> routes_;
+};
+
+// ============================================================================
+// Shared-Memory Transport
+// ============================================================================
+//
+// Same-host clients that call at a high rate can skip HTTP and the socket
+// layer. A client connects to the --shm-socket Unix socket and receives a
+// memfd over it. The memfd holds two single-producer/single-consumer rings,
+// one for requests and one for responses. From then on, calls cost no
+// syscalls as long as both sides are spinning. Linux only.
+
+#if defined(__linux__)
+
+/**
+ * @brief Indices and wakeup word of one ring, shared by both processes
+ * 
+ * head and tail count the bytes ever published and released, and each has
+ * its own cache line. A side that runs out of messages (or room) raises
+ * sleepers and parks on the futex word wake. The other side bumps wake
+ * only when sleepers is non-zero, so nobody makes a syscall while both
+ * sides are busy.
+ */
+struct ShmRingControl {
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+    alignas(64) std::atomic<uint32_t> wake{0};
+    std::atomic<uint32_t> sleepers{0};
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "ring indices are shared between processes and must be lock-free");
+
+/**
+ * @brief Start of the shared region; ring data follows at kDataOffset
+ * 
+ * The request ring's data starts at kDataOffset and the response ring's
+ * right after it, ring_bytes each.
+ */
+struct ShmRegionHeader {
+    static constexpr uint32_t kMagic = 0x5250434D;   // "MCPR"
+    static constexpr uint32_t kVersion = 1;
+    static constexpr size_t kDataOffset = 4096;
+    
+    uint32_t magic = kMagic;
+    uint32_t version = kVersion;
+    uint64_t ring_bytes = 0;
+    // Set by either side when it leaves
+    std::atomic<uint32_t> closed{0};
+    ShmRingControl requests;    // client to server
+    ShmRingControl responses;   // server to client
+};
+
+static_assert(sizeof(ShmRegionHeader) <= ShmRegionHeader::kDataOffset, "header overlaps the rings");
+
+/**
+ * @brief One direction of a shared-memory channel, seen from one side
+ * 
+ * Messages are framed in place: an 8-byte header (uint32 length, uint32
+ * kind) and the payload, padded to 8 bytes. A message never wraps. If it
+ * does not fit before the end of the ring, a padding frame fills the rest
+ * and the message starts again at offset 0. The consumer reads a message
+ * where it lies and releases it when done.
+ */
+class ShmRing {
+public:
+    static constexpr uint32_t kMessage = 0;
+    static constexpr uint32_t kPadding = 1;
+    static constexpr size_t kFrameHeader = 8;
+    
+    ShmRing(ShmRingControl& control, char* data, uint64_t capacity)
+        : control_(control), data_(data), mask_(capacity - 1),
+          head_(control.head.load(std::memory_order_relaxed)),
+          tail_(control.tail.load(std::memory_order_relaxed)) {
+        tail_cache_ = tail_;
+        head_cache_ = head_;
+    }
+    
+    /**
+     * @brief Largest message a ring of this capacity always has room for
+     */
+    static uint64_t maxMessage(uint64_t capacity) {
+        return capacity / 2 - kFrameHeader;
+    }
+    
+    /**
+     * @brief Space for a message of up to length bytes (producer only)
+     * @return nullptr while the consumer has not released enough yet
+     */
+    char* reserve(size_t length) {
+        uint64_t frame = frame_size(length);
+        uint64_t position = head_ & mask_;
+        uint64_t contiguous = mask_ + 1 - position;
+        uint64_t padding = frame > contiguous ? contiguous : 0;
+        if (head_ + padding + frame - tail_cache_ > mask_ + 1) {
+            tail_cache_ = control_.tail.load(std::memory_order_acquire);
+            if (head_ + padding + frame - tail_cache_ > mask_ + 1) {
+                return nullptr;
+            }
+        }
+        if (padding > 0) {
+            write_header(position, static_cast<uint32_t>(padding - kFrameHeader), kPadding);
+            position = 0;
+        }
+        padding_ = padding;
+        return data_ + position + kFrameHeader;
+    }
+    
+    /**
+     * @brief Make the reserved message visible with its final length (producer only)
+     */
+    void publish(size_t length) {
+        write_header((head_ + padding_) & mask_, static_cast<uint32_t>(length), kMessage);
+        head_ += padding_ + frame_size(length);
+        control_.head.store(head_, std::memory_order_release);
+        wake_peer();
+    }
+    
+    /**
+     * @brief The oldest unreleased message, in place (consumer only)
+     * @return false if there is none
+     * @throws std::runtime_error if the peer wrote a frame that does not fit the ring
+     */
+    bool peek(std::string_view& message) {
+        for (;;) {
+            if (tail_ == head_cache_) {
+                head_cache_ = control_.head.load(std::memory_order_acquire);
+                if (tail_ == head_cache_) {
+                    return false;
+                }
+                if (head_cache_ - tail_ > mask_ + 1) {
+                    throw std::runtime_error("Shared-memory ring index out of range");
+                }
+            }
+            // tail_ only ever moves by whole frames, so it stays 8-byte aligned
+            // and a header always fits before the end of the ring
+            uint64_t position = tail_ & mask_;
+            uint32_t header[2];
+            std::memcpy(header, data_ + position, sizeof(header));
+            if (position + kFrameHeader + header[0] > mask_ + 1 ||
+                frame_size(header[0]) > head_cache_ - tail_ ||
+                (header[1] == kPadding && (header[0] & 7) != 0)) {
+                throw std::runtime_error("Corrupt frame in shared-memory ring");
+            }
+            if (header[1] == kPadding) {
+                tail_ += kFrameHeader + header[0];
+                continue;
+            }
+            message = std::string_view(data_ + position + kFrameHeader, header[0]);
+            pending_ = frame_size(header[0]);
+            return true;
+        }
+    }
+    
+    /**
+     * @brief Hand the message returned by peek() back to the producer (consumer only)
+     */
+    void release() {
+        tail_ += pending_;
+        pending_ = 0;
+        control_.tail.store(tail_, std::memory_order_release);
+        wake_peer();
+    }
+    
+private:
+    static uint64_t frame_size(uint64_t length) {
+        return kFrameHeader + ((length + 7) & ~uint64_t(7));
+    }
+    
+    void write_header(uint64_t position, uint32_t length, uint32_t kind) {
+        uint32_t header[2] = {length, kind};
+        std::memcpy(data_ + position, header, sizeof(header));
+    }
+    
+    void wake_peer() {
+        // Pairs with the fence in ShmWaiter::wait: either we see the sleeper,
+        // or it sees the index we just stored
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (control_.sleepers.load(std::memory_order_relaxed) != 0) {
+            control_.wake.fetch_add(1, std::memory_order_relaxed);
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&control_.wake), FUTEX_WAKE,
+                    INT_MAX, nullptr, nullptr, 0);
+        }
+    }
+    
+    ShmRingControl& control_;
+    char* data_;
+    uint64_t mask_;
+    // Producer side
+    uint64_t head_;
+    uint64_t tail_cache_;
+    uint64_t padding_ = 0;
+    // Consumer side
+    uint64_t tail_;
+    uint64_t head_cache_;
+    uint64_t pending_ = 0;
+};
+
+/**
+ * @brief Spin-then-sleep wait on a ring, with a spin budget that adapts
+ * 
+ * Spinning picks up the next message within a few hundred nanoseconds but
+ * keeps a core busy. Sleeping on the futex frees the core but costs a few
+ * microseconds to wake. The budget doubles each time spinning paid off and
+ * halves each time the waiter had to sleep. A client calling back to back
+ * finds the server spinning, and an idle client costs no CPU. On a single
+ * CPU the peer cannot run while we spin, so the waiter goes straight to sleep.
+ */
+class ShmWaiter {
+public:
+    static constexpr uint32_t kMinSpins = 64;
+    static constexpr uint32_t kMaxSpins = 1 << 16;
+    
+    ShmWaiter()
+        : max_spins_(std::thread::hardware_concurrency() > 1 ? kMaxSpins : 0), spins_(max_spins_) {}
+    
+    /**
+     * @brief Wait until ready() holds or timeout passes asleep
+     * @return The last value of ready()
+     */
+    template<typename Ready>
+    bool wait(ShmRingControl& control, Ready&& ready, std::chrono::milliseconds timeout) {
+        for (uint32_t i = 0; i < spins_; ++i) {
+            if (ready()) {
+                spins_ = std::min(spins_ * 2, max_spins_);
+                return true;
+            }
+            cpu_relax();
+        }
+        spins_ = std::max(spins_ / 2, std::min(kMinSpins, max_spins_));
+        
+        control.sleepers.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint32_t seen = control.wake.load(std::memory_order_relaxed);
+        bool result = ready();
+        if (!result) {
+            struct timespec interval = {static_cast<time_t>(timeout.count() / 1000),
+                                        static_cast<long>(timeout.count() % 1000) * 1000000};
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&control.wake), FUTEX_WAIT,
+                    seen, &interval, nullptr, 0);
+            result = ready();
+        }
+        control.sleepers.fetch_sub(1, std::memory_order_relaxed);
+        return result;
+    }
+    
+private:
+    uint32_t max_spins_;
+    uint32_t spins_;
+};
+
+/**
+ * @brief One client's shared-memory region and the thread that serves it
+ * 
+ * Requests are handled one at a time on the channel's own thread, through
+ * the same McpDispatcher as HTTP. Tool calls go through the executor like
+ * HTTP calls, so they share its deadline ordering and worker limit; the
+ * channel thread waits for the result and cancels the call if the client
+ * leaves meanwhile. A client that wants calls to overlap opens more
+ * channels. Each channel counts as one session for SessionState and for
+ * logging/setLevel.
+ */
+class ShmChannel : public McpDispatcher {
+public:
+    ShmChannel(ServerContext& server, asio::local::stream_protocol::socket socket, uint64_t ring_bytes)
+        : McpDispatcher(server), server_(server), socket_(std::move(socket)) {
+        uint64_t capacity = 4096;
+        while (capacity < ring_bytes) {
+            capacity <<= 1;
+        }
+        size_ = ShmRegionHeader::kDataOffset + 2 * capacity;
+        
+        memfd_ = memfd_create("mcp-shm", MFD_CLOEXEC);
+        if (memfd_ < 0 || ftruncate(memfd_, static_cast<off_t>(size_)) != 0) {
+            throw std::system_error(errno, std::generic_category(), "memfd");
+        }
+        void* region = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, memfd_, 0);
+        if (region == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "mmap");
+        }
+        region_ = static_cast<char*>(region);
+        header_ = new (region_) ShmRegionHeader();
+        header_->ring_bytes = capacity;
+        
+        char* data = region_ + ShmRegionHeader::kDataOffset;
+        requests_ = std::make_unique<ShmRing>(header_->requests, data, capacity);
+        responses_ = std::make_unique<ShmRing>(header_->responses, data + capacity, capacity);
+        max_message_ = ShmRing::maxMessage(capacity);
+        writer_ = std::make_shared<ChunkedJsonWriter>([this](OutputChunk&& chunk) {
+            scratch_.append(chunk.buffer.data(), chunk.size);
+        });
+    }
+    
+    ~ShmChannel() {
+        if (region_) {
+            header_->closed.store(1, std::memory_order_release);
+            munmap(region_, size_);
+        }
+        if (memfd_ >= 0) {
+            close(memfd_);
+        }
+    }
+    
+    ShmChannel(const ShmChannel&) = delete;
+    ShmChannel& operator=(const ShmChannel&) = delete;
+    
+    /**
+     * @brief Send the memfd to the client over the Unix socket (SCM_RIGHTS)
+     * 
+     * The one data byte carries nothing; the client checks the header's
+     * magic and version after mapping the region.
+     */
+    void handshake() {
+        char byte = 'M';
+        struct iovec iov = {&byte, 1};
+        alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        struct msghdr message = {};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &memfd_, sizeof(int));
+        if (sendmsg(socket_.native_handle(), &message, MSG_NOSIGNAL) != 1) {
+            throw std::system_error(errno, std::generic_category(), "sendmsg");
+        }
+    }
+    
+    /**
+     * @brief Serve requests until the client leaves or stop is set
+     */
+    void run(const std::atomic<bool>& stop) {
+        stop_ = &stop;
+        ShmWaiter waiter;
+        std::string_view message;
+        while (!stop.load(std::memory_order_relaxed)) {
+            bool ready = waiter.wait(header_->requests, [&] {
+                return requests_->peek(message) || header_->closed.load(std::memory_order_acquire) != 0;
+            }, kPollInterval);
+            if (header_->closed.load(std::memory_order_acquire) != 0) {
+                break;
+            }
+            flush_outbox();
+            if (!ready) {
+                if (peer_gone()) {
+                    break;
+                }
+                continue;
+            }
+            
+            json request;
+            bool parsed = utf8_valid(message);
+            if (parsed) {
+                request = json::parse(message.begin(), message.end(), nullptr, false);
+                parsed = !request.is_discarded();
+            }
+            // The client may queue its next request while this one runs
+            requests_->release();
+            if (!parsed) {
+                send_error(json(), -32700, "Parse error");
+            } else {
+                handle(request);
+            }
+        }
+    }
+    
+private:
+    static constexpr std::chrono::milliseconds kPollInterval{100};
+    
+    /**
+     * @brief Notifications for the client, posted from any thread
+     * 
+     * The channel thread sends them while it waits for a call and between
+     * requests; a waiting call sleeps on the same condition variable, so a
+     * record is not held back until the call finishes.
+     */
+    struct Outbox {
+        void post(std::string message) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                messages.push_back(std::move(message));
+            }
+            cv.notify_one();
+        }
+        
+        std::vector<std::string> take() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return std::exchange(messages, {});
+        }
+        
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<std::string> messages;
+    };
+    
+    /**
+     * @brief A tool call handed to the executor, finished by the worker
+     */
+    struct PendingCall {
+        enum Status { Running, Done, Expired };
+        
+        explicit PendingCall(std::shared_ptr<Outbox> box) : outbox(std::move(box)) {}
+        
+        void finish(Status outcome, ToolResultWriter&& output, std::string message) {
+            {
+                std::lock_guard<std::mutex> lock(outbox->mutex);
+                status = outcome;
+                result = std::move(output);
+                error = std::move(message);
+            }
+            outbox->cv.notify_one();
+        }
+        
+        /**
+         * @brief Wait for the worker, sending notifications as they are posted
+         * @return false if gone() turned true first
+         */
+        template<typename Gone, typename Send>
+        bool wait(Gone&& gone, Send&& send) {
+            std::unique_lock<std::mutex> lock(outbox->mutex);
+            while (true) {
+                bool woken = outbox->cv.wait_for(lock, kPollInterval, [this] {
+                    return status != Running || !outbox->messages.empty();
+                });
+                // Records posted before finish() go out ahead of the response
+                Status now = status;
+                std::vector<std::string> messages = std::exchange(outbox->messages, {});
+                lock.unlock();
+                for (const std::string& message : messages) {
+                    send(message);
+                }
+                if (now != Running) {
+                    return true;
+                }
+                if (!woken && gone()) {
+                    return false;
+                }
+                lock.lock();
+            }
+        }
+        
+        std::shared_ptr<Outbox> outbox;
+        Status status = Running;
+        ToolResultWriter result;
+        std::string error;
+    };
+    
+    /**
+     * @brief Whether the channel should stop: client gone, region closed or server stopping
+     */
+    bool left() {
+        return (stop_ && stop_->load(std::memory_order_relaxed)) ||
+               header_->closed.load(std::memory_order_acquire) != 0 || peer_gone();
+    }
+    
+    /**
+     * @brief Whether the client closed its end of the Unix socket
+     */
+    bool peer_gone() {
+        char byte;
+        ssize_t n = recv(socket_.native_handle(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+    }
+    
+    void handle(const json& request) {
+        json response = dispatch(request, Clock::now());
+        if (!response.is_null()) {
+            send_message(request, response.dump());
+        }
+    }
+    
+    ToolCatalog& catalog() override { return catalog_; }
+    
+    // Nothing pushes registry changes into the ring; clients poll tools/list with ifNoneMatch
+    bool notifies_list_changed() const override { return false; }
+    
+    void call_tool(const json& request, ToolCall call) override {
+        if (Clock::now() >= call.deadline) {
+            send_error(request, -32001, "Request timed out");
+            return;
+        }
+        
+        auto pending = std::make_shared<PendingCall>(outbox_);
+        CancellationToken cancellation = CancellationToken::create();
+        RequestJournal* journal = server_.journal;
+        Clock::time_point deadline = call.deadline;
+        size_t page_size = call.page_size;
+        server_.executor.submit(deadline, cancellation,
+            [pending, call = std::move(call), cancellation, journal, executor = &server_.executor,
+             state = state_, log = log_, id = request.value("id", json())]() {
+                uint64_t seq = journal ? journal->begin("", id, call.name, call.arguments) : 0;
+                ToolResultWriter result;
+                std::string error;
+                try {
+                    ToolContext context(call.deadline, executor, cancellation);
+                    context.setSession({}, state);
+                    context.setLog(log, call.name);
+                    call.tool->execute(call.arguments, context, result);
+                } catch (const std::exception& e) {
+                    error = e.what();
+                    if (log) {
+                        log->log(LogLevel::Error, "server", [&] {
+                            return "Tool " + call.name + " failed: " + error;
+                        });
+                    }
+                }
+                if (journal) {
+                    journal->complete(seq, !error.empty() ? "error" : cancellation.cancelled() ? "cancelled" : "ok");
+                }
+                pending->finish(PendingCall::Done, std::move(result), std::move(error));
+            },
+            [pending, log = log_, name = call.name]() {
+                if (log) {
+                    log->log(LogLevel::Warning, "server", [&] {
+                        return "Call to " + name + " expired before a worker picked it up";
+                    });
+                }
+                pending->finish(PendingCall::Expired, ToolResultWriter(), "");
+            });
+        
+        if (!pending->wait([this] { return left(); }, [this](const std::string& message) { send_notification(message); })) {
+            cancellation.cancel();
+            return;
+        }
+        if (pending->status == PendingCall::Expired) {
+            send_error(request, -32001, "Request timed out");
+            return;
+        }
+        if (!pending->error.empty()) {
+            send_error(request, -32603, "Tool execution error: " + pending->error);
+            return;
+        }
+        ToolResultWriter result = std::move(pending->result);
+        
+        if (page_size == 0 || !result.expandResult() || ResultBuffer::pagedSize(result) <= page_size) {
+            scratch_.clear();
+            result.writeTo(writer_);
+            OutputChunk tail = writer_->takeTail();
+            scratch_.append(tail.buffer.data(), tail.size);
+            if (envelope_size(request, scratch_.size()) <= max_message_) {
+                std::string body = std::move(scratch_);
+                send_raw(request, body);
+                scratch_ = std::move(body);
+                return;
+            }
+            if (!results_ || !result.expandResult()) {
+                send_error(request, -32000, "Result does not fit the shared-memory ring");
+                return;
+            }
+            // Escaping can grow text up to six times; pages this size always fit
+            page_size = max_message_ / 8;
+        }
+        if (!results_) {
+            send_error(request, -32000, "Paged results are disabled");
+            return;
+        }
+        auto buffered = std::make_shared<ToolResultWriter>(std::move(result));
+        ResultCursor cursor;
+        cursor.result_id = results_->put(buffered, page_size, owner_);
+        send_result(request, binary_as_base64(ResultBuffer::page(*buffered, cursor, page_size)));
+    }
+    
+    /**
+     * @brief The channel's log records go into its outbox, sent between and during calls
+     */
+    void set_log_level(const json& request, LogLevel level) override {
+        if (!log_) {
+            log_ = std::make_shared<SessionLog>(config_.log_rate, config_.log_burst,
+                [outbox = outbox_](json message) {
+                    outbox->post(message.dump());
+                });
+        }
+        log_->setLevel(level);
+        send_result(request, json::object());
+    }
+    
+    // Buffered results are in memory or a local spool file; read them on the channel thread
+    void fetch_result(const json& request, const std::string& method, Clock::time_point) override {
+        json params = request.value("params", json::object());
+        send_result(request, method == "tools/result/next"
+            ? binary_as_base64(results_->next(params, owner_)) : results_->read(params, owner_));
+    }
+    
+    /**
+     * @brief Send what the outbox holds, e.g. log records posted after the last call finished
+     */
+    void flush_outbox() {
+        for (const std::string& message : outbox_->take()) {
+            send_notification(message);
+        }
+    }
+    
+    void send_result(const json& request, const json& result) {
+        send_raw(request, result.dump());
+    }
+    
+    void send_error(const json& request, int code, const std::string& message) {
+        send_raw(request, json{{"code", code}, {"message", message}}.dump(), "error");
+    }
+    
+    static size_t envelope_size(const json& request, size_t body) {
+        return body + 64 + (request.is_object() && request.contains("id") ? request["id"].dump().size() : 4);
+    }
+    
+    /**
+     * @brief Frame {"id":...,"jsonrpc":"2.0","result":body} straight into the response ring
+     */
+    void send_raw(const json& request, std::string_view body, std::string_view member = "result") {
+        std::string id = request.is_object() && request.contains("id") ? request["id"].dump() : "null";
+        size_t length = id.size() + member.size() + body.size() + 30;
+        if (length > max_message_) {
+            send_error(request, -32000, "Response does not fit the shared-memory ring");
+            return;
+        }
+        write_frame({"{\"id\":", id, ",\"jsonrpc\":\"2.0\",\"", member, "\":", body, "}"});
+    }
+    
+    /**
+     * @brief Send a whole serialized response, or an error if it does not fit
+     */
+    void send_message(const json& request, std::string_view message) {
+        if (message.size() > max_message_) {
+            send_error(request, -32000, "Response does not fit the shared-memory ring");
+            return;
+        }
+        write_frame({message});
+    }
+    
+    void send_notification(std::string_view message) {
+        // Records are small; one that does not fit is dropped like a rate-limited one
+        if (message.size() <= max_message_) {
+            write_frame({message});
+        }
+    }
+    
+    /**
+     * @brief Copy the parts into one frame of the response ring
+     * 
+     * Waits for room while the client has not caught up; gives up if the
+     * client leaves meanwhile.
+     */
+    void write_frame(std::initializer_list<std::string_view> parts) {
+        size_t length = 0;
+        for (std::string_view part : parts) {
+            length += part.size();
+        }
+        
+        char* frame = responses_->reserve(length);
+        ShmWaiter waiter;
+        while (!frame) {
+            bool ready = waiter.wait(header_->responses, [&] {
+                frame = responses_->reserve(length);
+                return frame != nullptr || header_->closed.load(std::memory_order_acquire) != 0;
+            }, kPollInterval);
+            if (header_->closed.load(std::memory_order_acquire) != 0 || (!ready && peer_gone())) {
+                return;
+            }
+        }
+        
+        char* out = frame;
+        for (std::string_view part : parts) {
+            std::memcpy(out, part.data(), part.size());
+            out += part.size();
+        }
+        responses_->publish(length);
+    }
+    
+    ServerContext& server_;
+    asio::local::stream_protocol::socket socket_;
+    const std::atomic<bool>* stop_ = nullptr;
+    int memfd_ = -1;
+    size_t size_ = 0;
+    char* region_ = nullptr;
+    ShmRegionHeader* header_ = nullptr;
+    std::unique_ptr<ShmRing> requests_;
+    std::unique_ptr<ShmRing> responses_;
+    uint64_t max_message_ = 0;
+    // Tool results are serialized here, then copied into the ring in one go
+    std::shared_ptr<ChunkedJsonWriter> writer_;
+    std::string scratch_;
+    // The channel is the client's session; its tool state goes with it
+    std::shared_ptr<SessionState> state_ = std::make_shared<SessionState>();
+    // Owner of the channel's buffered results
+    std::string owner_ = "shm:" + random_hex(16);
+    ToolCatalog catalog_;
+    std::shared_ptr<Outbox> outbox_ = std::make_shared<Outbox>();
+    // Set by logging/setLevel; calls made before that log nothing
+    std::shared_ptr<SessionLog> log_;
+};
+
+/**
+ * @brief Listens on the --shm-socket path and gives each client a channel thread
+ * 
+ * At most --shm-max-channels channels are open at once; further clients
+ * are disconnected before they get a region.
+ */
+class ShmTransport {
+public:
+    ShmTransport(ServerContext& server, asio::io_context& context)
+        : server_(server), acceptor_(context) {
+        const std::string& path = server_.config.shm_socket;
+        ::unlink(path.c_str());
+        asio::local::stream_protocol::endpoint endpoint(path);
+        acceptor_.open(endpoint.protocol());
+        acceptor_.bind(endpoint);
+        acceptor_.listen();
+        accept();
+    }
+    
+    ~ShmTransport() {
+        stop_.store(true, std::memory_order_relaxed);
+        for (auto& worker : workers_) {
+            worker.thread.join();
+        }
+        ::unlink(server_.config.shm_socket.c_str());
+    }
+    
+    ShmTransport(const ShmTransport&) = delete;
+    ShmTransport& operator=(const ShmTransport&) = delete;
+    
+private:
+    struct Worker {
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> done;
+    };
+    
+    void accept() {
+        acceptor_.async_accept([this](std::error_code ec, asio::local::stream_protocol::socket socket) {
+            if (ec) {
+                return;
+            }
+            reap();
+            if (workers_.size() >= server_.config.shm_max_channels) {
+                std::cerr << "Refusing shared-memory client: " << workers_.size()
+                          << " channels already open" << std::endl;
+                accept();
+                return;
+            }
+            try {
+                auto channel = std::make_shared<ShmChannel>(server_, std::move(socket), server_.config.shm_ring_bytes);
+                channel->handshake();
+                auto done = std::make_shared<std::atomic<bool>>(false);
+                workers_.push_back({std::thread([this, channel, done]() {
+                    try {
+                        channel->run(stop_);
+                    } catch (const std::exception& e) {
+                        std::cerr << "Shared-memory channel closed: " << e.what() << std::endl;
+                    }
+                    done->store(true, std::memory_order_release);
+                }), done});
+                std::cout << "Shared-memory channel opened" << std::endl;
+            } catch (const std::exception& e) {
+                std::cerr << "Shared-memory handshake failed: " << e.what() << std::endl;
+            }
+            accept();
+        });
+    }
+    
+    /**
+     * @brief Join the threads of channels whose clients have left
+     */
+    void reap() {
+        for (auto it = workers_.begin(); it != workers_.end();) {
+            if (it->done->load(std::memory_order_acquire)) {
+                it->thread.join();
+                it = workers_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    
+    ServerContext& server_;
+    asio::local::stream_protocol::acceptor acceptor_;
+    std::atomic<bool> stop_{false};
+    std::list<Worker> workers_;
+};
+
+#endif
+
+// ============================================================================
+// MCP Session and Server
+// ============================================================================
+
+class MCPSession : public McpDispatcher, public std::enable_shared_from_this<MCPSession> {
+public:
+    MCPSession(tcp::socket socket, ServerContext& server, Shard& shard)
+        : McpDispatcher(server), socket_(std::move(socket)), executor_(server.executor),
+          shards_(server.shards), shard_(shard), journal_(server.journal) {}
+
+    ~MCPSession() {
+        if (!session_id_.empty()) {
+            // Keep the entry for a reconnect; the owner's reaper drops it later.
+            // The last reference may be dropped on a tool worker thread.
+            ShardSet& shards = shards_;
+            size_t owner = shards_.owner_of(session_id_);
+            shards_.run_on(owner, [&shards, owner, id = session_id_]() {
+                auto& sessions = shards[owner].sessions();
+                auto it = sessions.find(id);
+                if (it != sessions.end() && it->second.stream.expired()) {
+                    it->second.last_seen = Clock::now();
+                }
+            });
+        }
+    }
+    
+    /**
+     * @brief Queue an SSE frame for this stream (on this session's shard thread)
+     */
+    void push_sse(std::shared_ptr<const std::string> frame) {
+        if (!socket_.is_open()) {
+            return;
+        }
+        sse_queue_.push_back(std::move(frame));
+        if (!sse_writing_) {
+            write_sse();
+        }
+    }
+    
+    void push_sse(const SseEvent& event) {
+        if (!socket_.is_open()) {
+            return;
+        }
+        sse_queue_.push_back(event.head);
+        sse_queue_.push_back(event.body);
+        if (!sse_writing_) {
+            write_sse();
+        }
+    }
+
+    void start() {
+        shard_.counters().connections++;
+        spawn(serve());
+    }
+
+private:
+    /**
+     * @brief Run a coroutine of this session on its io thread
+     * 
+     * The completion handler holds the reference that keeps the session
+     * alive until the coroutine ends, so nothing inside it needs
+     * shared_from_this(). An exception escaping the coroutine is logged and
+     * closes the connection. Safe to call from any thread: the coroutine
+     * starts by hopping onto the socket's executor.
+     */
+    void spawn(asio::awaitable<void> task) {
+        asio::co_spawn(socket_.get_executor(), std::move(task),
+            [self = shared_from_this()](std::exception_ptr error) {
+                if (!error) {
+                    return;
+                }
+                try {
+                    std::rethrow_exception(error);
+                } catch (const std::exception& e) {
+                    std::cerr << "Session error: " << e.what() << std::endl;
+                }
+                self->socket_.close();
+            });
+    }
+    
+    /**
+     * @brief The connection's exchange: read the header block, route it, respond
+     */
+    asio::awaitable<void> serve() {
+        asio::error_code ec;
+        co_await asio::async_read_until(socket_, buffer_, "\r\n\r\n", asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) {
+            std::cerr << "Error reading request: " << ec.message() << std::endl;
+            co_return;
+        }
+        request_start_ = Clock::now();
+        
+        HttpRequest request = parse_request();
+        RouteHandler handler = route(request);
+        if (!handler) {
+            co_await write_fixed(kNotFoundResponse);
+            co_return;
+        }
+        co_await (this->*handler)(request);
+    }
+    
+    /**
+     * @brief Parse the request line and headers waiting in buffer_
+     */
+    HttpRequest parse_request() {
+        std::istream is(&buffer_);
+        std::string request_line;
+        std::getline(is, request_line);
+        
+        // Parse HTTP method and path
+        std::istringstream iss(request_line);
+        std::string method, path, version;
+        iss >> method >> path >> version;
+        
+        if (config_.trace_requests) {
+            std::cout << "Request: " << method << " " << path << std::endl;
+        }
+        shard_.counters().requests++;
+        
+        HttpRequest request;
+        request.method = parse_http_method(method);
+        auto query_pos = path.find('?');
+        if (query_pos != std::string::npos) {
+            query_.parse(path.substr(query_pos + 1));
+            path.erase(query_pos);
+        } else {
+            query_.parse({});
+        }
+        request.path = std::move(path);
+        
+        // Read headers
+        auto& headers = request.headers;
+        std::string line;
+        while (std::getline(is, line) && line != "\r") {
+            auto colon_pos = line.find(':');
+            if (colon_pos != std::string::npos) {
+                std::string key = line.substr(0, colon_pos);
+                std::string value = line.substr(colon_pos + 2);
+                if (!value.empty() && value.back() == '\r') {
+                    value.pop_back();
+                }
+                // Convert key to lowercase for case-insensitive lookup
+                std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+                headers[key] = value;
+            }
+        }
+        
+        if (config_.trace_requests) {
+            std::cout << "Headers received:" << std::endl;
+            for (const auto& h : headers) {
+                std::cout << "  " << h.first << ": " << h.second << std::endl;
+            }
+        }
+        
+        return request;
+    }
+
+    using RouteHandler = asio::awaitable<void> (MCPSession::*)(const HttpRequest&);
+    
+    /**
+     * @brief The route table, shared read-only by every session on every shard
+     */
+    static const Router<RouteHandler>& routes() {
+        static const Router<RouteHandler> router = [] {
+            Router<RouteHandler> r;
+            r.add(HttpMethod::Post, "/", &MCPSession::handle_post);
+            r.add(HttpMethod::Post, "/message", &MCPSession::handle_post);
+            r.add(HttpMethod::Get, "/", &MCPSession::handle_sse);
+            r.add(HttpMethod::Get, "/sse", &MCPSession::handle_sse);
+            r.add(HttpMethod::Get, "/tools", &MCPSession::handle_get_tools);
+            r.add(HttpMethod::Get, "/metrics", &MCPSession::handle_metrics);
+            r.add(HttpMethod::Get, "/sessions/{id}", &MCPSession::handle_session_info);
+            for (const char* path : {"/", "/message", "/sse"}) {
+                r.add(HttpMethod::Options, path, &MCPSession::handle_options);
+            }
+            return r;
+        }();
+        return router;
+    }
+    
+    /**
+     * @brief Match the request against the route table and count it
+     * @return The route's handler, or nullptr for a 404
+     */
+    RouteHandler route(HttpRequest& request) {
+        const auto& router = routes();
+        size_t route = router.match(request);
+        ShardCounters& counters = shard_.counters();
+        if (route == SIZE_MAX) {
+            counters.unrouted++;
+            return nullptr;
+        }
+        
+        if (counters.routes.size() <= route) {
+            counters.routes.resize(router.routes().size());
+        }
+        counters.routes[route]++;
+        return router.routes()[route].handler;
+    }
+    
+    asio::awaitable<void> handle_sse(const HttpRequest& request) {
+        if (config_.trace_requests) {
+            std::cout << "SSE connection requested" << std::endl;
+        }
+        send_sse_stream(request);
+        co_return;
+    }
+    
+    asio::awaitable<void> handle_options(const HttpRequest&) {
+        co_await write_fixed(kCorsResponse);
+    }
+    
+    /**
+     * @brief The tools/list payload over plain HTTP, with conditional GET
+     * 
+     * A matching If-None-Match gets a 304 carrying only the tag; otherwise the
+     * shard's pre-serialized body goes out as is.
+     */
+    asio::awaitable<void> handle_get_tools(const HttpRequest& request) {
+        auto list = shard_.tools().list();
+        const std::string& etag = list->etag;
+        std::string validators =
+            "ETag: " + etag + "\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Access-Control-Allow-Origin: *\r\n"
+            "Access-Control-Expose-Headers: ETag\r\n"
+            "Connection: close\r\n";
+        
+        auto it = request.headers.find("if-none-match");
+        if (it != request.headers.end() && etag_matches(it->second, etag)) {
+            co_await write_raw("HTTP/1.1 304 Not Modified\r\n" + validators + "\r\n", nullptr);
+            co_return;
+        }
+        
+        const auto& body = list->body;
+        co_await write_raw(
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: application/json\r\n"
+            "Content-Length: " + std::to_string(body->size()) + "\r\n" +
+            validators + "\r\n",
+            body);
+    }
+    
+    /**
+     * @brief Prometheus-style counters summed over all shards
+     * 
+     * Each shard's counters are read on that shard's own thread, one shard
+     * after another; the response goes out once all of them are in.
+     */
+    asio::awaitable<void> handle_metrics(const HttpRequest&) {
+        ShardCounters total;
+        size_t sessions = 0;
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            auto [snapshot, count] = co_await on_shard(i, [this, i]() {
+                return std::make_pair(shards_[i].counters(), shards_[i].sessions().size());
+            });
+            total.connections += snapshot.connections;
+            total.requests += snapshot.requests;
+            total.tool_calls += snapshot.tool_calls;
+            total.unrouted += snapshot.unrouted;
+            if (total.routes.size() < snapshot.routes.size()) {
+                total.routes.resize(snapshot.routes.size());
+            }
+            for (size_t r = 0; r < snapshot.routes.size(); ++r) {
+                total.routes[r] += snapshot.routes[r];
+            }
+            sessions += count;
+        }
+        co_await write_text(format_metrics(total, sessions), "text/plain; version=0.0.4");
+    }
+    
+    static std::string format_metrics(const ShardCounters& counters, size_t sessions) {
+        std::ostringstream out;
+        out << "mcp_connections_total " << counters.connections << "\n";
+        out << "mcp_requests_total " << counters.requests << "\n";
+        out << "mcp_tool_calls_total " << counters.tool_calls << "\n";
+        out << "mcp_unrouted_requests_total " << counters.unrouted << "\n";
+        out << "mcp_sessions " << sessions << "\n";
+        
+        const auto& table = routes().routes();
+        for (size_t r = 0; r < table.size(); ++r) {
+            out << "mcp_route_requests_total{method=\"" << http_method_name(table[r].method)
+                << "\",route=\"" << table[r].pattern << "\"} "
+                << (r < counters.routes.size() ? counters.routes[r] : 0) << "\n";
+        }
+        return out.str();
+    }
+    
+    /**
+     * @brief Session table entry for /sessions/{id}, fetched from its owning shard
+     */
+    asio::awaitable<void> handle_session_info(const HttpRequest& request) {
+        std::string id(request.param("id"));
+        size_t owner = shards_.owner_of(id);
+        if (owner == SIZE_MAX) {
+            co_await write_fixed(kNotFoundResponse);
+            co_return;
+        }
+        
+        json info = co_await on_shard(owner, [this, &id, owner]() {
+            json info;
+            auto& sessions = shards_[owner].sessions();
+            auto it = sessions.find(id);
+            if (it != sessions.end()) {
+                auto idle = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    Clock::now() - it->second.last_seen);
+                info = {
+                    {"sessionId", id},
+                    {"shard", owner},
+                    {"streamOpen", !it->second.stream.expired()},
+                    {"messages", it->second.messages},
+                    {"lastEventId", it->second.last_event_id},
+                    {"protocolVersion", it->second.protocol_version},
+                    {"clientInfo", it->second.client_info},
+                    {"replayEvents", it->second.replay.size()},
+                    {"idleMs", idle.count()}
+                };
+                if (auto log = shards_.logs().find(id)) {
+                    info["log"] = {
+                        {"level", log_level_name(log->level())},
+                        {"sent", log->sent()},
+                        {"dropped", log->dropped()}
+                    };
+                }
+            }
+            return info;
+        });
+        if (info.is_null()) {
+            co_await write_fixed(kNotFoundResponse);
+        } else {
+            co_await write_response(info);
+        }
+    }
+    
+    /**
+     * @brief Run fn on the thread of shard index and resume here with its result
+     * 
+     * Both hops go through ShardSet::run_on, so between shards they ride the
+     * SPSC queues. On this session's own shard fn simply runs inline.
+     */
+    template<typename Fn>
+    asio::awaitable<std::invoke_result_t<Fn&>> on_shard(size_t index, Fn fn) {
+        using Result = std::invoke_result_t<Fn&>;
+        if (index == shard_.index()) {
+            co_return fn();
+        }
+        
+        ShardSet& shards = shards_;
+        size_t home = shard_.index();
+        co_return co_await asio::async_initiate<decltype(asio::use_awaitable), void(Result)>(
+            [&shards, &fn, index, home](auto handler) {
+                auto waiting = std::make_shared<decltype(handler)>(std::move(handler));
+                shards.run_on(index, [&shards, &fn, home, waiting]() {
+                    auto result = std::make_shared<Result>(fn());
+                    shards.run_on(home, [waiting, result]() {
+                        std::move(*waiting)(std::move(*result));
+                    });
+                });
+            }, asio::use_awaitable);
+    }
+
+    /**
+     * @brief Open an SSE stream, resuming an existing session when asked to
+     * 
+     * GET /sse?sessionId=<id>&resumeToken=<token> reattaches to a session
+     * that is still in its owner's table, taking over its stream. The token
+     * is the one the session's first endpoint event carried, so knowing a
+     * session ID is not enough to hijack its stream. With a Last-Event-ID
+     * header, the events after that ID are replayed from the session's
+     * buffer. Anything else starts a new session.
+     */
+    void send_sse_stream(const HttpRequest& request) {
+        std::string resume_id(query_.get("sessionId"));
+        std::string resume_token(query_.get("resumeToken"));
+        size_t owner = shards_.owner_of(resume_id);
+        if (owner == SIZE_MAX || resume_token.empty()) {
+            start_sse(shards_.new_session_id(shard_.index()), {}, "");
+            return;
+        }
+        
+        std::optional<uint64_t> last_event_id;
+        auto it = request.headers.find("last-event-id");
+        if (it != request.headers.end()) {
+            last_event_id = std::strtoull(it->second.c_str(), nullptr, 10);
+        }
+        
+        auto self(shared_from_this());
+        size_t home = shard_.index();
+        shards_.run_on(owner, [this, self, owner, home, resume_id, resume_token, last_event_id]() {
+            auto& sessions = shards_[owner].sessions();
+            auto entry = sessions.find(resume_id);
+            bool found = entry != sessions.end() && secret_equals(entry->second.resume_token, resume_token);
+            std::vector<SseEvent> backlog;
+            if (found) {
+                SessionInfo& info = entry->second;
+                info.stream = self;
+                info.stream_shard = home;
+                info.last_seen = Clock::now();
+                if (last_event_id) {
+                    info.replay.forEach([&backlog, &last_event_id](const SseEvent& event) {
+                        if (event.id > *last_event_id) {
+                            backlog.push_back(event);
+                        }
+                    });
+                }
+            }
+            shards_.run_on(home, [this, self, found, resume_id, resume_token,
+                                  backlog = std::move(backlog)]() mutable {
+                if (found) {
+                    std::cout << "Resuming SSE session " << resume_id << ", replaying "
+                              << backlog.size() << " event(s)" << std::endl;
+                    start_sse(resume_id, std::move(backlog), resume_token);
+                } else {
+                    start_sse(shards_.new_session_id(shard_.index()), {}, "");
                 }
             });
+        });
     }
 
-    void handle_get_request(const std::string& path, const std::unordered_map<std::string, std::string>& headers) {
-        // For SSE endpoint
-        if (path == "/" || path == "/sse") {
-            std::cout << "SSE connection requested" << std::endl;
-            send_sse_stream();
+    /**
+     * @brief Start streaming a session; resume_token is empty for a new session
+     */
+    void start_sse(std::string session_id, std::vector<SseEvent> backlog, std::string resume_token) {
+        session_id_ = std::move(session_id);
+        bool resumed = !resume_token.empty();
+        if (!resumed) {
+            resume_token = random_hex(16);
+        }
+        if (shards_.owner_of(session_id_) == shard_.index()) {
+            // Register (or re-register) with this shard; the ID tells POSTs where to find it
+            SessionInfo& info = shard_.sessions()[session_id_];
+            info.stream = shared_from_this();
+            info.stream_shard = shard_.index();
+            info.resume_token = resume_token;
+            shards_.states().attach(session_id_);
+            shard_.markSessionsChanged();
+        }
+        
+        json endpoint_msg = {
+            {"jsonrpc", "2.0"},
+            {"method", "endpoint"},
+            {"params", {
+                {"endpoint", "/message?sessionId=" + session_id_},
+                {"resumeToken", resume_token}
+            }}
+        };
+        if (resumed) {
+            // The session (possibly restored from the store) is still initialized
+            endpoint_msg["params"]["resumed"] = true;
+        }
+        
+        push_sse(std::make_shared<const std::string>(
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/event-stream\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Connection: keep-alive\r\n"
+            "Access-Control-Allow-Origin: *\r\n"
+            "\r\n"
+            "data: " + endpoint_msg.dump() + "\n\n"));
+        for (const auto& event : backlog) {
+            push_sse(event);
+        }
+        sse_timer_ = std::make_unique<asio::steady_timer>(socket_.get_executor());
+        keep_alive_sse();
+        watch_sse_peer();
+    }
+
+    /**
+     * @brief Notice a client hanging up right away rather than on the next failed write
+     * 
+     * Once the stream object is gone the session entry can start lingering
+     * toward the reaper.
+     */
+    void watch_sse_peer() {
+        auto self(shared_from_this());
+        socket_.async_read_some(asio::buffer(probe_),
+            [this, self](std::error_code ec, std::size_t) {
+                if (!ec) {
+                    watch_sse_peer();
+                } else if (socket_.is_open()) {
+                    std::cout << "SSE client disconnected: " << ec.message() << std::endl;
+                    close_sse();
+                }
+            });
+    }
+
+    void close_sse() {
+        sse_queue_.clear();
+        if (sse_timer_) {
+            sse_timer_->cancel();
+        }
+        socket_.close();
+    }
+
+    /**
+     * @brief Write everything queued so far in one gather write
+     */
+    void write_sse() {
+        sse_writing_ = true;
+        // Both vectors keep their capacity, so a stream that is up to speed
+        // writes without allocating
+        std::swap(sse_queue_, sse_batch_);
+        sse_buffers_.clear();
+        for (const auto& frame : sse_batch_) {
+            sse_buffers_.push_back(asio::buffer(*frame));
+        }
+        
+        auto self(shared_from_this());
+        asio::async_write(socket_, sse_buffers_,
+            [this, self](std::error_code ec, std::size_t) {
+                sse_writing_ = false;
+                sse_batch_.clear();
+                if (ec) {
+                    std::cerr << "Error sending SSE: " << ec.message() << std::endl;
+                    close_sse();
+                } else if (!sse_queue_.empty()) {
+                    write_sse();
+                }
+            });
+    }
+
+    void keep_alive_sse() {
+        static const auto keepalive = std::make_shared<const std::string>(": keepalive\n\n");
+        auto self(shared_from_this());
+        sse_timer_->expires_after(std::chrono::seconds(30));
+        sse_timer_->async_wait([this, self](std::error_code ec) {
+            if (!ec && socket_.is_open()) {
+                push_sse(keepalive);
+                keep_alive_sse();
+            }
+        });
+    }
+
+    /**
+     * @brief POST /message: read the body, handle it, write the response
+     * 
+     * Requests answered on the spot are written from here. The others
+     * (tools/call and the like) respond later, from a tool worker or another
+     * shard, through send_response() or stream_response().
+     */
+    asio::awaitable<void> handle_post(const HttpRequest& request) {
+        const auto& headers = request.headers;
+        auto it = headers.find("content-length");
+        size_t content_length = 0;
+        bool valid = it != headers.end();
+        if (valid) {
+            try {
+                content_length = std::stoull(it->second);
+            } catch (const std::exception&) {
+                valid = false;
+            }
+        }
+        if (!valid) {
+            std::cout << "Missing or invalid content-length header" << std::endl;
+            co_await write_fixed(kBadRequestResponse);
+            co_return;
+        }
+        
+        note_session_activity();
+        negotiate_format(headers);
+        
+        auto timeout_it = headers.find("x-request-timeout");
+        if (timeout_it != headers.end()) {
+            try {
+                header_timeout_ = std::chrono::milliseconds(std::stoll(timeout_it->second));
+            } catch (const std::exception&) {
+                std::cout << "Ignoring invalid X-Request-Timeout: " << timeout_it->second << std::endl;
+            }
+        }
+        
+        // Part of the body may have arrived with the headers; the rest is read
+        // straight into place
+        std::string body(content_length, '\0');
+        size_t available = static_cast<size_t>(buffer_.sgetn(body.data(), static_cast<std::streamsize>(content_length)));
+        if (available < content_length) {
+            asio::error_code ec;
+            co_await asio::async_read(socket_, asio::buffer(body.data() + available, content_length - available),
+                                      asio::redirect_error(asio::use_awaitable, ec));
+            if (ec) {
+                std::cerr << "Error reading remaining body: " << ec.message() << std::endl;
+                co_return;
+            }
+        }
+        
+        json response = handle_message(body);
+        if (!response.is_null()) {
+            co_await write_response(response);
+        }
+    }
+
+    /**
+     * @brief Pick the request and response encodings from Content-Type and Accept
+     * 
+     * The request is JSON unless Content-Type names CBOR or MessagePack. The
+     * response uses the first of the three formats listed in Accept, or the
+     * request's format if Accept lists none of them.
+     */
+    void negotiate_format(const std::unordered_map<std::string, std::string>& headers) {
+        auto type = headers.find("content-type");
+        if (type == headers.end() || !parse_wire_format(type->second, request_format_)) {
+            request_format_ = WireFormat::Json;
+        }
+        reply_format_ = request_format_;
+        
+        auto accept = headers.find("accept");
+        if (accept != headers.end()) {
+            std::string_view ranges = accept->second;
+            while (!ranges.empty()) {
+                size_t comma = ranges.find(',');
+                if (parse_wire_format(ranges.substr(0, comma), reply_format_)) {
+                    break;
+                }
+                ranges.remove_prefix(comma == std::string_view::npos ? ranges.size() : comma + 1);
+            }
+        }
+    }
+    
+    /**
+     * @brief A value for the response body: binary data becomes base64 for JSON clients
+     */
+    json for_reply(json value) const {
+        if (reply_format_ == WireFormat::Json && contains_binary(value)) {
+            return binary_as_base64(value);
+        }
+        return value;
+    }
+
+    /**
+     * @brief Decode and handle one JSON-RPC message
+     * @return The response, or null if it is sent later by whoever finishes the request
+     */
+    json handle_message(const std::string& message) {
+        if (request_format_ == WireFormat::Json && !utf8_valid(message)) {
+            std::cerr << "Request body is not valid UTF-8" << std::endl;
+            return create_error_response(json{}, -32700, "Parse error");
+        }
+        
+        try {
+            json request;
+            switch (request_format_) {
+                case WireFormat::Cbor: request = json::from_cbor(message); break;
+                case WireFormat::MsgPack: request = json::from_msgpack(message); break;
+                default: request = json::parse(message); break;
+            }
+            if (config_.trace_requests) {
+                std::cout << "Received: " << request.dump(2) << std::endl;
+            }
+
+            return dispatch(request, request_start_, header_timeout_);
+        } catch (const json::exception& e) {
+            std::cerr << "JSON error: " << e.what() << std::endl;
+            return create_error_response(json{}, -32700, "Parse error");
+        }
+    }
+
+    /**
+     * @brief Record a POST against its session on the shard that owns it
+     */
+    void note_session_activity() {
+        std::string session_id(query_.get("sessionId"));
+        size_t owner = shards_.owner_of(session_id);
+        if (owner == SIZE_MAX) {
+            return;
+        }
+        
+        ShardSet& shards = shards_;
+        shards_.run_on(owner, [&shards, owner, session_id]() {
+            auto& sessions = shards[owner].sessions();
+            auto it = sessions.find(session_id);
+            if (it != sessions.end()) {
+                it->second.messages++;
+                it->second.last_seen = Clock::now();
+            }
+        });
+    }
+
+    /**
+     * @brief Store what initialize negotiated in the session entry, if the POST names a session
+     * 
+     * With a session store this is what lets the client skip initialize
+     * after a server restart.
+     */
+    void on_initialize(const json& request) override {
+        std::string session_id(query_.get("sessionId"));
+        size_t owner = shards_.owner_of(session_id);
+        if (owner == SIZE_MAX) {
+            return;
+        }
+        
+        json params = request.value("params", json::object());
+        if (!params.is_object()) {
+            return;
+        }
+        ShardSet& shards = shards_;
+        shards_.run_on(owner, [&shards, owner, session_id, params = std::move(params)]() {
+            auto& sessions = shards[owner].sessions();
+            auto it = sessions.find(session_id);
+            if (it == sessions.end()) {
+                return;
+            }
+            it->second.protocol_version = kProtocolVersion;
+            it->second.client_capabilities = params.value("capabilities", json::object());
+            it->second.client_info = params.value("clientInfo", json::object());
+            shards[owner].markSessionsChanged();
+        });
+    }
+
+    /**
+     * @brief logging/setLevel: send the session's client log records at or above a level
+     * 
+     * The POST names the session with ?sessionId=, and the records arrive
+     * on its SSE stream.
+     */
+    void set_log_level(const json& request, LogLevel level) override {
+        std::string session_id(query_.get("sessionId"));
+        size_t owner = shards_.owner_of(session_id);
+        if (owner == SIZE_MAX) {
+            send_response(create_error_response(request, -32602, "logging/setLevel needs the sessionId of an SSE session"));
+            return;
+        }
+        
+        auto self(shared_from_this());
+        size_t home = shard_.index();
+        shards_.run_on(owner, [this, self, request, session_id, owner, home, level]() {
+            json response;
+            if (shards_[owner].sessions().count(session_id)) {
+                ShardSet& shards = shards_;
+                auto log = shards_.logs().attach(session_id, [&]() {
+                    return std::make_shared<SessionLog>(config_.log_rate, config_.log_burst,
+                        [&shards, owner, session_id](json message) {
+                            shards.run_on(owner, [&shards, owner, session_id, message = std::move(message)]() {
+                                shards[owner].publish(session_id, message);
+                            });
+                        });
+                });
+                log->setLevel(level);
+                response = result_response(request, json::object());
+            } else {
+                response = create_error_response(request, -32602, "Unknown session: " + session_id);
+            }
+            shards_.run_on(home, [this, self, response = std::move(response)]() {
+                send_response(response);
+            });
+        });
+    }
+
+    ToolCatalog& catalog() override { return shard_.tools(); }
+    
+    void call_tool(const json& request, ToolCall call) override {
+        auto self(shared_from_this());
+        shard_.counters().tool_calls++;
+        
+        CancellationToken cancellation = CancellationToken::create();
+        watch_for_disconnect(cancellation);
+        
+        std::string session_id(query_.get("sessionId"));
+        auto log = session_id.empty() ? nullptr : shards_.logs().find(session_id);
+        auto state = session_id.empty() ? nullptr : shards_.states().find(session_id);
+        Clock::time_point deadline = call.deadline;
+        executor_.submit(deadline, cancellation,
+            [this, self, call = std::move(call), session_id, log, state, request, cancellation]() {
+                const std::string& tool_name = call.name;
+                const json& arguments = call.arguments;
+                Clock::time_point deadline = call.deadline;
+                uint64_t seq = 0;
+                if (journal_) {
+                    seq = journal_->begin(session_id, request.value("id", json()), tool_name, arguments);
+                }
+                
+                ToolResultWriter result;
+                try {
+                    ToolContext context(deadline, &executor_, cancellation);
+                    context.setSession(session_id, state);
+                    context.setLog(log, tool_name);
+                    call.tool->execute(arguments, context, result);
+                } catch (const std::exception& e) {
+                    if (journal_) {
+                        journal_->complete(seq, "error");
+                    }
+                    if (log) {
+                        log->log(LogLevel::Error, "server", [&] {
+                            return "Tool " + tool_name + " failed: " + e.what();
+                        });
+                    }
+                    json error = create_error_response(request, -32603, std::string("Tool execution error: ") + e.what());
+                    stream_response(error, cancellation);
+                    return;
+                }
+                if (journal_) {
+                    journal_->complete(seq, cancellation.cancelled() ? "cancelled" : "ok");
+                }
+                
+                size_t page_size = call.page_size;
+                if (page_size > 0 && result.expandResult() && ResultBuffer::pagedSize(result) > page_size) {
+                    auto buffered = std::make_shared<ToolResultWriter>(std::move(result));
+                    ResultCursor cursor;
+                    cursor.result_id = results_->put(buffered, page_size, session_id);
+                    stream_response(result_response(request, for_reply(ResultBuffer::page(*buffered, cursor, page_size))),
+                                    cancellation);
+                    return;
+                }
+                if (reply_format_ != WireFormat::Json) {
+                    stream_response(result_response(request, result.toJson()), cancellation);
+                    return;
+                }
+                
+                // {"id":...,"jsonrpc":"2.0","result":...} - id only if present
+                stream_body(request, [&](const std::shared_ptr<ChunkedJsonWriter>& out) {
+                    out->write_character('{');
+                    if (request.contains("id")) {
+                        out->write_literal("\"id\":");
+                        ChunkedJsonWriter::dump(request["id"], out);
+                        out->write_character(',');
+                    }
+                    out->write_literal("\"jsonrpc\":\"2.0\",\"result\":");
+                    result.writeTo(out);
+                    out->write_character('}');
+                }, cancellation);
+            },
+            [this, self, request, tool_name = call.name, log]() {
+                std::cout << "Dropping expired tools/call before execution" << std::endl;
+                if (log) {
+                    log->log(LogLevel::Warning, "server", [&] {
+                        return "Call to " + tool_name + " expired before a worker picked it up";
+                    });
+                }
+                json error = create_error_response(request, -32001, "Request timed out");
+                asio::post(socket_.get_executor(), [this, self, error = std::move(error)]() {
+                    send_response(error);
+                });
+            });
+    }
+
+    void fetch_result(const json& request, const std::string& method, Clock::time_point deadline) override {
+        auto self(shared_from_this());
+        CancellationToken cancellation = CancellationToken::create();
+        watch_for_disconnect(cancellation);
+        
+        std::string owner(query_.get("sessionId"));
+        executor_.submit(deadline, cancellation,
+            [this, self, request, method, owner, cancellation]() {
+                json response;
+                try {
+                    json params = request.value("params", json::object());
+                    response = result_response(request, method == "tools/result/next"
+                        ? for_reply(results_->next(params, owner)) : results_->read(params, owner));
+                } catch (const std::exception& e) {
+                    response = create_error_response(request, -32602, e.what());
+                }
+                stream_response(response, cancellation);
+            },
+            [this, self, request]() {
+                json error = create_error_response(request, -32001, "Request timed out");
+                asio::post(socket_.get_executor(), [this, self, error = std::move(error)]() {
+                    send_response(error);
+                });
+            });
+    }
+    
+    /**
+     * @brief Keep a read armed while a tool call runs to notice the client leaving
+     * 
+     * A client only ever sends one request per connection, so the read
+     * completing with EOF or a reset means it has given up; the call's
+     * token is cancelled so queued work is dropped and running tools can stop.
+     */
+    void watch_for_disconnect(CancellationToken cancellation) {
+        auto self(shared_from_this());
+        socket_.async_read_some(asio::buffer(probe_),
+            [this, self, cancellation](std::error_code ec, std::size_t) {
+                if (!ec) {
+                    // Unexpected extra bytes - ignore them and keep watching
+                    watch_for_disconnect(cancellation);
+                } else if (socket_.is_open()) {
+                    // Our own close() aborts the read too; only a live socket means the peer left
+                    std::cout << "Client disconnected during tools/call: " << ec.message() << std::endl;
+                    disconnected_ = true;
+                    cancellation.cancel();
+                }
+            });
+    }
+
+    /**
+     * @brief Status line and headers for a JSON-RPC response in the negotiated format
+     * @param content_length Body size, or SIZE_MAX for chunked transfer encoding
+     */
+    std::string response_headers(size_t content_length) const {
+        std::string headers = "HTTP/1.1 200 OK\r\nContent-Type: ";
+        headers += wire_format_content_type(reply_format_);
+        headers += "\r\n";
+        if (content_length == SIZE_MAX) {
+            headers += "Transfer-Encoding: chunked\r\n";
         } else {
-            send_404();
+            headers += "Content-Length: " + std::to_string(content_length) + "\r\n";
+        }
+        headers +=
+            "Access-Control-Allow-Origin: *\r\n"
+            "Access-Control-Allow-Methods: POST, OPTIONS\r\n"
+            "Access-Control-Allow-Headers: Content-Type\r\n"
+            "Connection: close\r\n"
+            "\r\n";
+        return headers;
+    }
+
+    /**
+     * @brief Send a response from a callback (posted work, another shard's reply)
+     */
+    void send_response(const json& response) {
+        spawn(write_response(response));
+    }
+    
+    /**
+     * @brief Serialize a response and send it with Content-Length
+     * 
+     * The body is written straight into pooled blocks and sent as a gather
+     * write, with no intermediate string. Serializing happens right away, so
+     * the returned coroutine does not refer to response.
+     */
+    asio::awaitable<void> write_response(const json& response) {
+        std::vector<OutputChunk> chunks;
+        auto writer = std::make_shared<ChunkedJsonWriter>([&chunks](OutputChunk&& chunk) {
+            chunks.push_back(std::move(chunk));
+        });
+        ChunkedJsonWriter::encode(response, reply_format_, writer);
+        chunks.push_back(writer->takeTail());
+        return write_chunks(std::move(chunks));
+    }
+
+    /**
+     * @brief Write the headers and the blocks, then close; the blocks live in the coroutine frame
+     */
+    asio::awaitable<void> write_chunks(std::vector<OutputChunk> chunks) {
+        if (disconnected_) {
+            std::cout << "Client gone; dropping response" << std::endl;
+            socket_.close();
+            co_return;
+        }
+        
+        size_t length = 0;
+        for (const auto& chunk : chunks) {
+            length += chunk.size;
+        }
+        std::string headers = response_headers(length);
+        std::vector<asio::const_buffer> buffers;
+        buffers.push_back(asio::buffer(headers));
+        for (const auto& chunk : chunks) {
+            buffers.push_back(asio::buffer(chunk.buffer.data(), chunk.size));
+        }
+        
+        asio::error_code ec;
+        co_await asio::async_write(socket_, buffers, asio::redirect_error(asio::use_awaitable, ec));
+        finish_write(ec);
+    }
+    
+    /**
+     * @brief Close the connection once its response is out (one exchange per connection)
+     */
+    void finish_write(const asio::error_code& ec) {
+        if (ec) {
+            std::cerr << "Error writing: " << ec.message() << std::endl;
         }
+        socket_.close();
     }
 
-    void send_sse_stream() {
-        std::ostringstream response;
-        response << "HTTP/1.1 200 OK\r\n";
-        response << "Content-Type: text/event-stream\r\n";
-        response << "Cache-Control: no-cache\r\n";
-        response << "Connection: keep-alive\r\n";
-        response << "Access-Control-Allow-Origin: *\r\n";
-        response << "\r\n";
-        
-        // Send initial endpoint info
-        json endpoint_msg = {
-            {"jsonrpc", "2.0"},
-            {"method", "endpoint"},
-            {"params", {
-                {"endpoint", "/message"}
-            }}
+    /**
+     * @brief Shared between a serializing tool worker and the io thread
+     */
+    struct StreamState {
+        struct Pending {
+            std::string prefix;     // headers, or the chunk-size line
+            OutputChunk chunk;
+            FileRegion file;        // sent with sendfile() instead of chunk
+            const char* suffix = "";
         };
         
-        response << "data: " << endpoint_msg.dump() << "\n\n";
-        
-        auto self(shared_from_this());
-        auto response_str = std::make_shared<std::string>(response.str());
+        explicit StreamState(CancellationToken cancellation) : cancellation(std::move(cancellation)) {}
         
-        asio::async_write(socket_, asio::buffer(*response_str),
-            [this, self, response_str](std::error_code ec, std::size_t) {
-                if (!ec) {
-                    std::cout << "SSE stream established" << std::endl;
-                    // Keep connection alive for SSE
-                    keep_alive_sse();
-                } else {
-                    std::cerr << "Error sending SSE: " << ec.message() << std::endl;
-                }
-            });
+        std::mutex mutex;
+        std::condition_variable drained;
+        std::deque<Pending> pending;
+        size_t in_flight = 0;       // queued or being written
+        bool writing = false;
+        bool failed = false;
+        CancellationToken cancellation;
+    };
+    
+    static constexpr size_t kMaxChunksInFlight = 4;
+    // A worker gives up on a client that has taken no chunk for this long
+    static constexpr std::chrono::seconds kSendStallTimeout{30};
+    // How often a worker waiting for the socket checks for cancellation
+    static constexpr std::chrono::milliseconds kCancelPoll{100};
+
+    /**
+     * @brief Serialize a response on a tool worker, streaming it to the client
+     * 
+     * A response that fits in one block is sent with Content-Length. Larger
+     * ones switch to chunked transfer encoding: each block goes out as soon as
+     * it is full, and the worker waits while kMaxChunksInFlight blocks are
+     * still unsent, so memory per response stays constant whatever its size.
+     * The wait ends when the call is cancelled or the client takes no chunk
+     * for kSendStallTimeout, so a client that stops reading cannot hold a
+     * worker. Spooled text goes out of its temporary file with sendfile().
+     */
+    void stream_response(const json& response, const CancellationToken& cancellation) {
+        stream_body(response, [&](const std::shared_ptr<ChunkedJsonWriter>& out) {
+            ChunkedJsonWriter::encode(response, reply_format_, out);
+        }, cancellation);
     }
 
-    void keep_alive_sse() {
+    /**
+     * @brief Same as stream_response(), with the body produced by a callback
+     * 
+     * If produce() throws before anything was sent, the client gets an
+     * internal error for the request instead; after that the connection
+     * is closed mid-body, which the client sees as a truncated response.
+     * @param request Request answered by the body (for its id)
+     */
+    void stream_body(const json& request,
+                     const std::function<void(const std::shared_ptr<ChunkedJsonWriter>&)>& produce,
+                     const CancellationToken& cancellation) {
         auto self(shared_from_this());
-        auto timer = std::make_shared<asio::steady_timer>(socket_.get_executor(), std::chrono::seconds(30));
-        timer->async_wait([this, self, timer](std::error_code ec) {
-            if (!ec) {
-                std::string keepalive = ": keepalive\n\n";
-                asio::async_write(socket_, asio::buffer(keepalive),
-                    [this, self](std::error_code ec, std::size_t) {
-                        if (!ec) {
-                            keep_alive_sse();
-                        }
-                    });
+        auto abort = [this, self]() {
+            asio::post(socket_.get_executor(), [this, self]() { socket_.close(); });
+        };
+        if (cancellation.cancelled()) {
+            abort();
+            return;
+        }
+        
+        auto stream = std::make_shared<StreamState>(cancellation);
+        bool headers_queued = false;
+        auto start_chunk = [&]() {
+            if (cancellation.cancelled()) {
+                throw StreamAborted();
             }
+            if (!headers_queued) {
+                headers_queued = true;
+                enqueue_chunk(stream, response_headers(SIZE_MAX), OutputChunk());
+            }
+        };
+        auto writer = std::make_shared<ChunkedJsonWriter>([&](OutputChunk&& chunk) {
+            start_chunk();
+            enqueue_chunk(stream, "", std::move(chunk));
         });
-    }
-
-    void read_post_body(const std::unordered_map<std::string, std::string>& headers) {
-        auto it = headers.find("content-length");
-        if (it == headers.end()) {
-            std::cout << "No content-length header found" << std::endl;
-            send_400();
+#if defined(__linux__)
+        writer->setFileSink([&](FileRegion&& region) {
+            start_chunk();
+            enqueue_file(stream, std::move(region));
+        });
+#endif
+        
+        try {
+            produce(writer);
+        } catch (const StreamAborted&) {
+            std::cout << "Abandoned streaming a response to a departed or stalled client" << std::endl;
+            abort();
+            return;
+        } catch (const std::exception& e) {
+            std::cerr << "Error serializing response: " << e.what() << std::endl;
+            if (headers_queued) {
+                mark_failed(stream);
+                abort();
+                return;
+            }
+            json error = create_error_response(request, -32603, std::string("Could not serialize the result: ") + e.what());
+            asio::post(socket_.get_executor(), [this, self, error = std::move(error)]() {
+                send_response(error);
+            });
             return;
         }
         
-        size_t content_length = std::stoull(it->second);
-        std::cout << "Content-Length: " << content_length << std::endl;
-        auto self(shared_from_this());
+        OutputChunk tail = writer->takeTail();
+        if (writer->blocksEmitted() == 0) {
+            // Fit in a single block - plain Content-Length response
+            std::vector<OutputChunk> chunks;
+            chunks.push_back(std::move(tail));
+            spawn(write_chunks(std::move(chunks)));
+            return;
+        }
         
-        // Check how much data we already have in the buffer
-        size_t available = buffer_.size();
-        std::cout << "Available in buffer: " << available << std::endl;
-        
-        if (available >= content_length) {
-            // We already have all the body data
-            std::string body;
-            body.resize(content_length);
-            buffer_.sgetn(&body[0], content_length);
-            std::cout << "Body read from buffer: " << body << std::endl;
-            handle_message(body);
-        } else {
-            // Need to read more data
-            size_t bytes_to_read = content_length - available;
-            std::cout << "Need to read " << bytes_to_read << " more bytes" << std::endl;
-            
-            auto body_buffer = std::make_shared<std::string>();
-            body_buffer->resize(available);
-            buffer_.sgetn(&(*body_buffer)[0], available);
-            
-            auto remaining_buffer = std::make_shared<std::vector<char>>(bytes_to_read);
-            asio::async_read(socket_, asio::buffer(*remaining_buffer),
-                [this, self, body_buffer, remaining_buffer](std::error_code ec, std::size_t) {
-                    if (!ec) {
-                        body_buffer->append(remaining_buffer->begin(), remaining_buffer->end());
-                        std::cout << "Full body read: " << *body_buffer << std::endl;
-                        handle_message(*body_buffer);
-                    } else {
-                        std::cerr << "Error reading remaining body: " << ec.message() << std::endl;
-                    }
-                });
+        try {
+            if (tail.size > 0) {
+                enqueue_chunk(stream, "", std::move(tail));
+            }
+            enqueue_chunk(stream, "0\r\n\r\n", OutputChunk());
+        } catch (const StreamAborted&) {
+            abort();
         }
     }
+    
+    static void mark_failed(const std::shared_ptr<StreamState>& stream) {
+        std::lock_guard<std::mutex> lock(stream->mutex);
+        stream->failed = true;
+    }
 
-    void handle_message(const std::string& message) {
-        try {
-            auto request = json::parse(message);
-            std::cout << "Received: " << request.dump(2) << std::endl;
-
-            json response;
-            
-            // Handle JSON-RPC 2.0 requests
-            if (request.contains("method")) {
-                std::string method = request["method"];
-                
-                if (method == "initialize") {
-                    response = handle_initialize(request);
-                } else if (method == "tools/list") {
-                    response = handle_tools_list(request);
-                } else if (method == "tools/call") {
-                    response = handle_tools_call(request);
-                } else {
-                    response = create_error_response(request, -32601, "Method not found");
+    /**
+     * @brief Queue one chunk for the io thread, waiting while too many are unsent
+     * @param raw Written as-is instead of a framed chunk when non-empty
+     */
+    void enqueue_chunk(const std::shared_ptr<StreamState>& stream, std::string raw, OutputChunk chunk) {
+        StreamState::Pending item;
+        if (raw.empty()) {
+            item.prefix = chunk_size_line(chunk.size);
+            item.suffix = "\r\n";
+        } else {
+            item.prefix = std::move(raw);
+        }
+        item.chunk = std::move(chunk);
+        enqueue_pending(stream, std::move(item));
+    }
+    
+    /**
+     * @brief Queue a region of a spooled file as one chunk
+     */
+    void enqueue_file(const std::shared_ptr<StreamState>& stream, FileRegion region) {
+        StreamState::Pending item;
+        item.prefix = chunk_size_line(region.length);
+        item.file = std::move(region);
+        item.suffix = "\r\n";
+        enqueue_pending(stream, std::move(item));
+    }
+    
+    static std::string chunk_size_line(size_t size) {
+        char size_line[24];
+        std::snprintf(size_line, sizeof(size_line), "%zx\r\n", size);
+        return size_line;
+    }
+    
+    void enqueue_pending(const std::shared_ptr<StreamState>& stream, StreamState::Pending item) {
+        {
+            std::unique_lock<std::mutex> lock(stream->mutex);
+            Clock::time_point stalled = Clock::now() + kSendStallTimeout;
+            while (!stream->failed && stream->in_flight >= kMaxChunksInFlight) {
+                if (stream->cancellation.cancelled() || Clock::now() >= stalled) {
+                    stream->failed = true;
+                    break;
                 }
-            } else {
-                response = create_error_response(request, -32600, "Invalid Request");
+                stream->drained.wait_until(lock, std::min(stalled, Clock::now() + kCancelPoll));
             }
-
-            send_response(response);
-        } catch (const json::exception& e) {
-            std::cerr << "JSON error: " << e.what() << std::endl;
-            json error = create_error_response(json{}, -32700, "Parse error");
-            send_response(error);
+            if (stream->failed) {
+                throw StreamAborted();
+            }
+            stream->pending.push_back(std::move(item));
+            stream->in_flight++;
         }
+        
+        auto self(shared_from_this());
+        asio::post(socket_.get_executor(), [this, self, stream]() { pump_stream(stream); });
     }
 
-    json handle_initialize(const json& request) {
-        json response = {
-            {"jsonrpc", "2.0"},
-            {"result", {
-                {"protocolVersion", "2024-11-05"},
-                {"serverInfo", {
-                    {"name", "CustomMCP"},
-                    {"version", "1.0.0"}
-                }},
-                {"capabilities", {
-                    {"tools", json::object()}
-                }}
-            }}
-        };
-        
-        // Copy id if present
-        if (request.contains("id")) {
-            response["id"] = request["id"];
+    /**
+     * @brief Write queued chunks one at a time (io thread)
+     */
+    void pump_stream(const std::shared_ptr<StreamState>& stream) {
+        auto item = std::make_shared<StreamState::Pending>();
+        {
+            std::lock_guard<std::mutex> lock(stream->mutex);
+            if (stream->writing || stream->pending.empty() || stream->failed) {
+                return;
+            }
+            *item = std::move(stream->pending.front());
+            stream->pending.pop_front();
+            stream->writing = true;
         }
         
-        return response;
-    }
-
-    json handle_tools_list(const json& request) {
-        json response = {
-            {"jsonrpc", "2.0"},
-            {"result", {
-                {"tools", ToolRegistry::instance().getToolsList()}
-            }}
-        };
+        auto self(shared_from_this());
+        if (item->file.text) {
+            // Size line, then the file bytes straight from the page cache, then CRLF
+            asio::async_write(socket_, asio::buffer(item->prefix),
+                [this, self, stream, item](std::error_code ec, std::size_t) {
+                    if (ec) {
+                        chunk_written(stream, ec, false);
+                        return;
+                    }
+                    send_file_region(stream, item);
+                });
+            return;
+        }
         
-        // Copy id if present
-        if (request.contains("id")) {
-            response["id"] = request["id"];
+        std::vector<asio::const_buffer> buffers;
+        buffers.push_back(asio::buffer(item->prefix));
+        if (item->chunk.size > 0) {
+            buffers.push_back(asio::buffer(item->chunk.buffer.data(), item->chunk.size));
         }
+        buffers.push_back(asio::buffer(item->suffix, std::strlen(item->suffix)));
+        bool last = item->prefix == "0\r\n\r\n";
         
-        return response;
+        asio::async_write(socket_, buffers,
+            [this, self, stream, item, last](std::error_code ec, std::size_t) {
+                chunk_written(stream, ec, last);
+            });
     }
-
-    json handle_tools_call(const json& request) {
-        std::string tool_name = request["params"]["name"];
-        json arguments = request["params"]["arguments"];
-
-        json response = {
-            {"jsonrpc", "2.0"}
-        };
-        
-        // Copy id if present
-        if (request.contains("id")) {
-            response["id"] = request["id"];
-        }
-
-        auto tool = ToolRegistry::instance().getTool(tool_name);
-        if (tool) {
-            try {
-                response["result"] = tool->execute(arguments);
-            } catch (const std::exception& e) {
-                return create_error_response(request, -32603, std::string("Tool execution error: ") + e.what());
+    
+    /**
+     * @brief sendfile() the rest of a queued file region, waiting whenever the socket is full
+     */
+    void send_file_region(const std::shared_ptr<StreamState>& stream,
+                          const std::shared_ptr<StreamState::Pending>& item) {
+        auto self(shared_from_this());
+#if defined(__linux__)
+        asio::error_code option_ec;
+        socket_.native_non_blocking(true, option_ec);
+        std::error_code ec(option_ec.value(), std::system_category());
+        FileRegion& region = item->file;
+        int fd = region.text->fd();
+        while (!ec && region.length > 0) {
+            off_t offset = static_cast<off_t>(region.offset);
+            ssize_t n = ::sendfile(socket_.native_handle(), fd, &offset, std::min<size_t>(region.length, 1 << 30));
+            if (n > 0) {
+                region.offset += static_cast<uint64_t>(n);
+                region.length -= static_cast<size_t>(n);
+            } else if (n == 0) {
+                ec = std::make_error_code(std::errc::io_error);    // file shorter than the region
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                socket_.async_wait(tcp::socket::wait_write,
+                    [this, self, stream, item](std::error_code wait_ec) {
+                        if (wait_ec) {
+                            chunk_written(stream, wait_ec, false);
+                            return;
+                        }
+                        send_file_region(stream, item);
+                    });
+                return;
+            } else if (errno != EINTR) {
+                ec = std::error_code(errno, std::system_category());
             }
-        } else {
-            return create_error_response(request, -32602, "Unknown tool: " + tool_name);
         }
-
-        return response;
+        if (ec) {
+            chunk_written(stream, ec, false);
+            return;
+        }
+#endif
+        asio::async_write(socket_, asio::buffer(item->suffix, std::strlen(item->suffix)),
+            [this, self, stream, item](std::error_code ec, std::size_t) {
+                chunk_written(stream, ec, false);
+            });
     }
-
-    json create_error_response(const json& request, int code, const std::string& message) {
-        json response = {
-            {"jsonrpc", "2.0"},
-            {"error", {
-                {"code", code},
-                {"message", message}
-            }}
-        };
+    
+    /**
+     * @brief Account for a finished chunk write and move on to the next one
+     */
+    void chunk_written(const std::shared_ptr<StreamState>& stream, std::error_code ec, bool last) {
+        {
+            std::lock_guard<std::mutex> lock(stream->mutex);
+            stream->writing = false;
+            stream->in_flight--;
+            if (ec) {
+                stream->failed = true;
+            }
+        }
+        stream->drained.notify_all();
         
-        // Copy id if present, otherwise use null
-        if (request.contains("id")) {
-            response["id"] = request["id"];
+        if (ec) {
+            std::cerr << "Error writing: " << ec.message() << std::endl;
+            socket_.close();
+        } else if (last) {
+            socket_.close();
         } else {
-            response["id"] = nullptr;
+            pump_stream(stream);
         }
-        
-        return response;
     }
 
-    void send_response(const json& response) {
-        std::string body = response.dump();
-        std::ostringstream http_response;
-        
-        http_response << "HTTP/1.1 200 OK\r\n";
-        http_response << "Content-Type: application/json\r\n";
-        http_response << "Content-Length: " << body.length() << "\r\n";
-        http_response << "Access-Control-Allow-Origin: *\r\n";
-        http_response << "Access-Control-Allow-Methods: POST, OPTIONS\r\n";
-        http_response << "Access-Control-Allow-Headers: Content-Type\r\n";
-        http_response << "Connection: close\r\n";
-        http_response << "\r\n";
-        http_response << body;
-        
-        std::string message = http_response.str();
-        auto self(shared_from_this());
+    /**
+     * @brief Write a preformatted header block and an optional shared body, then close
+     */
+    asio::awaitable<void> write_raw(std::string head, std::shared_ptr<const std::string> body) {
+        std::vector<asio::const_buffer> buffers{asio::buffer(head)};
+        if (body) {
+            buffers.push_back(asio::buffer(*body));
+        }
         
-        asio::async_write(socket_, asio::buffer(message),
-            [this, self](std::error_code ec, std::size_t) {
-                if (ec) {
-                    std::cerr << "Error writing: " << ec.message() << std::endl;
-                }
-                socket_.close();
-            });
+        asio::error_code ec;
+        co_await asio::async_write(socket_, buffers, asio::redirect_error(asio::use_awaitable, ec));
+        finish_write(ec);
     }
 
-    void send_cors_response() {
-        std::string response = 
-            "HTTP/1.1 204 No Content\r\n"
-            "Access-Control-Allow-Origin: *\r\n"
-            "Access-Control-Allow-Methods: POST, OPTIONS\r\n"
-            "Access-Control-Allow-Headers: Content-Type\r\n"
-            "Connection: close\r\n"
-            "\r\n";
-        
-        auto self(shared_from_this());
-        asio::async_write(socket_, asio::buffer(response),
-            [this, self](std::error_code ec, std::size_t) {
-                socket_.close();
-            });
+    /**
+     * @brief Send a plain-text body with Content-Length and close
+     */
+    asio::awaitable<void> write_text(std::string body, const char* content_type) {
+        std::string head =
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: ";
+        head += content_type;
+        head += "\r\nContent-Length: " + std::to_string(body.size()) + "\r\n"
+                "Connection: close\r\n"
+                "\r\n";
+        return write_raw(std::move(head), std::make_shared<const std::string>(std::move(body)));
     }
 
-    void send_404() {
-        std::string response = 
-            "HTTP/1.1 404 Not Found\r\n"
-            "Content-Length: 0\r\n"
-            "Connection: close\r\n"
-            "\r\n";
-        
-        auto self(shared_from_this());
-        asio::async_write(socket_, asio::buffer(response),
-            [this, self](std::error_code ec, std::size_t) {
-                socket_.close();
-            });
-    }
+    // Fixed responses live in static storage, so nothing is formatted or
+    // allocated for them and the buffer outlives the write
+    static constexpr std::string_view kCorsResponse =
+        "HTTP/1.1 204 No Content\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "Access-Control-Allow-Methods: POST, OPTIONS\r\n"
+        "Access-Control-Allow-Headers: Content-Type\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+    
+    static constexpr std::string_view kNotFoundResponse =
+        "HTTP/1.1 404 Not Found\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+    
+    static constexpr std::string_view kBadRequestResponse =
+        "HTTP/1.1 400 Bad Request\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n"
+        "\r\n";
 
-    void send_400() {
-        std::string response = 
-            "HTTP/1.1 400 Bad Request\r\n"
-            "Content-Length: 0\r\n"
-            "Connection: close\r\n"
-            "\r\n";
-        
-        auto self(shared_from_this());
-        asio::async_write(socket_, asio::buffer(response),
-            [this, self](std::error_code ec, std::size_t) {
-                socket_.close();
-            });
+    asio::awaitable<void> write_fixed(std::string_view response) {
+        asio::error_code ec;
+        co_await asio::async_write(socket_, asio::buffer(response.data(), response.size()),
+                                   asio::redirect_error(asio::use_awaitable, ec));
+        finish_write(ec);
     }
 
     tcp::socket socket_;
     asio::streambuf buffer_;
+    ToolExecutor& executor_;
+    ShardSet& shards_;
+    Shard& shard_;
+    RequestJournal* journal_;
+    WireFormat request_format_ = WireFormat::Json;
+    WireFormat reply_format_ = WireFormat::Json;
+    QueryString query_;
+    std::string session_id_;
+    std::vector<std::shared_ptr<const std::string>> sse_queue_;
+    std::vector<std::shared_ptr<const std::string>> sse_batch_;     // being written
+    std::vector<asio::const_buffer> sse_buffers_;
+    bool sse_writing_ = false;
+    std::unique_ptr<asio::steady_timer> sse_timer_;
+    std::array<char, 1> probe_{};
+    bool disconnected_ = false;
+    Clock::time_point request_start_ = Clock::now();
+    std::chrono::milliseconds header_timeout_{0};
 };
 
+inline SseEvent Shard::make_event(std::shared_ptr<const std::string> body) {
+    uint64_t id = ++event_seq_;
+    if (id > event_ids_reserved_) {
+        markSessionsChanged();
+    }
+    return SseEvent{id, std::make_shared<const std::string>("id: " + std::to_string(id) + "\n"), std::move(body)};
+}
+
+inline void Shard::deliver(SessionInfo& info, const SseEvent& event, RemoteStreams* remote) {
+    info.last_event_id = event.id;
+    info.replay.push(event, replay_capacity_);
+    
+    if (info.stream.expired()) {
+        return;
+    }
+    if (info.stream_shard == index_) {
+        if (auto session = info.stream.lock()) {
+            session->push_sse(event);
+        }
+    } else if (remote) {
+        remote->resize(set_.size());
+        (*remote)[info.stream_shard].push_back(info.stream);
+    } else {
+        // Resumed from a connection on another shard
+        set_.run_on(info.stream_shard, [stream = info.stream, event]() {
+            if (auto session = stream.lock()) {
+                session->push_sse(event);
+            }
+        });
+    }
+}
+
+inline uint64_t Shard::publish(const std::string& session_id, const json& message) {
+    auto it = sessions_.find(session_id);
+    if (it == sessions_.end()) {
+        return 0;
+    }
+    
+    SseEvent event = make_event(std::make_shared<const std::string>("data: " + message.dump() + "\n\n"));
+    deliver(it->second, event);
+    return event.id;
+}
+
+inline void Shard::broadcast(std::shared_ptr<const std::string> body) {
+    if (sessions_.empty()) {
+        return;
+    }
+    SseEvent event = make_event(std::move(body));
+    RemoteStreams remote;
+    for (auto& entry : sessions_) {
+        deliver(entry.second, event, &remote);
+    }
+    
+    // One message per shard for the streams resumed there
+    for (size_t shard = 0; shard < remote.size(); ++shard) {
+        if (remote[shard].empty()) {
+            continue;
+        }
+        set_.run_on(shard, [streams = std::move(remote[shard]), event]() {
+            for (const auto& stream : streams) {
+                if (auto session = stream.lock()) {
+                    session->push_sse(event);
+                }
+            }
+        });
+    }
+}
+
+/**
+ * @brief Accepts connections and hands each one to a shard
+ * 
+ * On Linux every shard listens on the port itself through SO_REUSEPORT and
+ * the kernel spreads connections across them. Elsewhere shard 0 accepts and
+ * deals sockets out round-robin.
+ */
 class MCPServer {
 public:
-    MCPServer(asio::io_context& io_context, short port)
-        : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)) {
-        accept();
+    MCPServer(ServerContext& server) : server_(server) {
+        ShardSet& shards = server_.shards;
+        tcp::endpoint endpoint(tcp::v4(), server_.config.port);
+        
+#if defined(SO_REUSEPORT) && defined(__linux__)
+        size_t listeners = shards.size();
+#else
+        size_t listeners = 1;
+#endif
+        for (size_t i = 0; i < listeners; ++i) {
+            auto acceptor = std::make_unique<tcp::acceptor>(shards[i].context());
+            acceptor->open(endpoint.protocol());
+            acceptor->set_option(tcp::acceptor::reuse_address(true));
+#if defined(SO_REUSEPORT) && defined(__linux__)
+            if (listeners > 1) {
+                acceptor->set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+            }
+#endif
+#if defined(SO_BUSY_POLL)
+            if (server_.config.low_latency) {
+                // Raising SO_BUSY_POLL needs CAP_NET_ADMIN; without it sockets keep the system default
+                asio::error_code option_ec;
+                acceptor->set_option(asio::detail::socket_option::integer<SOL_SOCKET, SO_BUSY_POLL>(
+                    server_.config.busy_poll_us), option_ec);
+                if (option_ec && i == 0) {
+                    std::cerr << "SO_BUSY_POLL not set (" << option_ec.message()
+                              << "); socket busy polling stays at the system default" << std::endl;
+                }
+            }
+#endif
+#if defined(SO_INCOMING_CPU)
+            // Prefer the listener whose shard runs on the CPU that took the packet,
+            // keeping each connection on the node of its NIC queue
+            const auto& cpus = server_.config.io_cpus;
+            if (listeners > 1 && !cpus.empty()) {
+                acceptor->set_option(asio::detail::socket_option::integer<SOL_SOCKET, SO_INCOMING_CPU>(
+                    cpus[i % cpus.size()]));
+            }
+#endif
+            acceptor->bind(endpoint);
+            acceptor->listen();
+            acceptors_.push_back(std::move(acceptor));
+        }
+        
+        for (size_t i = 0; i < acceptors_.size(); ++i) {
+            accept(i);
+        }
     }
 
 private:
-    void accept() {
-        acceptor_.async_accept(
-            [this](std::error_code ec, tcp::socket socket) {
+    void accept(size_t listener) {
+        ShardSet& shards = server_.shards;
+        // A lone listener deals connections out; otherwise each shard keeps its own
+        Shard& target = acceptors_.size() == 1 ? shards[next_shard_++ % shards.size()] : shards[listener];
+        
+        acceptors_[listener]->async_accept(target.context(),
+            [this, listener, &target](std::error_code ec, tcp::socket socket) {
                 if (!ec) {
-                    std::cout << "New connection accepted" << std::endl;
-                    std::make_shared<MCPSession>(std::move(socket))->start();
+                    if (server_.config.trace_requests) {
+                        std::cout << "New connection accepted" << std::endl;
+                    }
+#if defined(SO_BUSY_POLL)
+                    if (server_.config.low_latency) {
+                        // Let the kernel spin on the NIC queue on reads from this socket
+                        asio::error_code option_ec;
+                        socket.set_option(asio::detail::socket_option::integer<SOL_SOCKET, SO_BUSY_POLL>(
+                            server_.config.busy_poll_us), option_ec);
+                    }
+#endif
+                    socket.set_option(tcp::no_delay(server_.config.low_latency));
+                    asio::post(target.context(), [this, &target, socket = std::move(socket)]() mutable {
+                        std::make_shared<MCPSession>(std::move(socket), server_, target)->start();
+                    });
                 }
-                accept();
+                accept(listener);
             });
     }
 
-    tcp::acceptor acceptor_;
+    ServerContext& server_;
+    std::vector<std::unique_ptr<tcp::acceptor>> acceptors_;
+    size_t next_shard_ = 0;
 };
 
-int main(int argc, char* argv[]) {
-    try {
-        short port = 3000;
+/**
+ * @brief Parse "[port] [--option=value ...]" into a ServerConfig
+ */
+ServerConfig parse_args(int argc, char* argv[]) {
+    ServerConfig config;
+    
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            config.port = static_cast<short>(std::atoi(arg.c_str()));
+            continue;
+        }
+        
+        auto eq = arg.find('=');
+        std::string name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+        std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
         
-        if (argc > 1) {
-            port = static_cast<short>(std::atoi(argv[1]));
+        if (name == "timeout-ms") {
+            config.default_timeout = std::chrono::milliseconds(std::stoll(value));
+        } else if (name == "workers") {
+            config.worker_threads = static_cast<size_t>(std::stoul(value));
+        } else if (name == "shards") {
+            config.shards = std::max<size_t>(1, std::stoul(value));
+        } else if (name == "thread-per-core") {
+            config.shards = std::max(1u, std::thread::hardware_concurrency());
+            config.pin_shards = true;
+        } else if (name == "pin") {
+            config.pin_shards = true;
+        } else if (name == "io-cpus") {
+            config.io_cpus = parse_cpu_list(value);
+        } else if (name == "worker-cpus") {
+            config.worker_cpus = parse_cpu_list(value);
+        } else if (name == "low-latency") {
+            config.low_latency = true;
+        } else if (name == "busy-poll-us") {
+            config.busy_poll_us = std::stoi(value);
+        } else if (name == "rt-priority") {
+            config.rt_priority = std::stoi(value);
+        } else if (name == "session-linger-s") {
+            config.session_linger = std::chrono::seconds(std::stoll(value));
+        } else if (name == "replay-events") {
+            config.replay_events = static_cast<size_t>(std::stoul(value));
+        } else if (name == "session-store") {
+            config.session_store = value;
+        } else if (name == "journal") {
+            config.journal = value;
+        } else if (name == "journal-sync-ms") {
+            config.journal_sync = std::chrono::milliseconds(std::stoll(value));
+        } else if (name == "journal-wait-sync") {
+            config.journal_wait_sync = true;
+        } else if (name == "result-buffers") {
+            config.result_buffers = static_cast<size_t>(std::stoul(value));
+        } else if (name == "result-ttl-s") {
+            config.result_ttl = std::chrono::seconds(std::stoll(value));
+        } else if (name == "log-rate") {
+            config.log_rate = std::stod(value);
+        } else if (name == "log-burst") {
+            config.log_burst = std::stod(value);
+        } else if (name == "shm-socket") {
+            config.shm_socket = value;
+        } else if (name == "shm-ring-kb") {
+            config.shm_ring_bytes = static_cast<size_t>(std::stoul(value)) << 10;
+        } else if (name == "shm-max-channels") {
+            config.shm_max_channels = std::max<size_t>(1, std::stoul(value));
+        } else if (name == "trace-requests") {
+            config.trace_requests = true;
+        } else {
+            throw std::invalid_argument("Unknown option: " + arg);
+        }
+    }
+    
+    if (config.low_latency && config.trace_requests) {
+        // Blocking console writes on the io threads would undo the busy polling
+        std::cerr << "--trace-requests is ignored in --low-latency mode" << std::endl;
+        config.trace_requests = false;
+    }
+    
+    if (config.pin_shards && config.io_cpus.empty()) {
+        for (size_t i = 0; i < config.shards; ++i) {
+            config.io_cpus.push_back(static_cast<int>(i));
         }
+    }
+    
+    return config;
+}
+
+#ifndef CUSTOMMCP_NO_MAIN
+// Benchmarks in bench/ include this file without the server's main()
+int main(int argc, char* argv[]) {
+    try {
+        ServerConfig config = parse_args(argc, argv);
 
         ToolRegistry::instance().registerTool<EchoTool>();
         
-        asio::io_context io_context;
-        MCPServer server(io_context, port);
+        if (config.low_latency && !lock_process_memory()) {
+            std::cerr << "mlockall failed; running with pageable memory" << std::endl;
+        }
+        
+        std::unique_ptr<RequestJournal> journal;
+        if (!config.journal.empty()) {
+            auto incomplete = RequestJournal::recover(config.journal);
+            for (const auto& record : incomplete) {
+                std::cerr << "Tool call did not complete before the last shutdown: " << record.dump() << std::endl;
+            }
+            if (std::ifstream(config.journal)) {
+                // Keep the old journal for inspection; its open calls move to the new one
+                std::filesystem::rename(config.journal, config.journal + ".prev");
+            }
+            std::cout << "Journal " << config.journal << ": " << incomplete.size()
+                      << " incomplete call(s) from the previous run" << std::endl;
+            journal = std::make_unique<RequestJournal>(config.journal, config.journal_sync,
+                                                       config.journal_wait_sync);
+            journal->carry(incomplete);
+        }
+        
+        std::unique_ptr<ResultBuffer> results;
+        if (config.result_buffers > 0) {
+            results = std::make_unique<ResultBuffer>(config.result_ttl, config.result_buffers);
+        }
+        
+        ToolExecutor executor(config.worker_threads, config.worker_cpus);
+        ShardSet shards(config.shards);
+        ToolRegistry::instance().setChangeListener([&shards](uint64_t epoch) {
+            shards.broadcast({
+                {"jsonrpc", "2.0"},
+                {"method", "notifications/tools/list_changed"},
+                {"params", {{"_meta", {{"epoch", epoch}}}}}
+            });
+        });
+        std::unique_ptr<SessionStore> store;
+        if (!config.session_store.empty()) {
+            store = std::make_unique<SessionStore>(config.session_store);
+            size_t restored = 0;
+            for (const auto& record : store->load(shards.size())) {
+                try {
+                    size_t owner = shards.owner_of(record.value("id", ""));
+                    if (owner != SIZE_MAX) {
+                        shards[owner].restore(record);
+                        restored++;
+                    }
+                } catch (const json::exception& e) {
+                    std::cerr << "Skipping unreadable session record: " << e.what() << std::endl;
+                }
+            }
+            std::cout << "Restored " << restored << " session(s) from " << config.session_store << std::endl;
+        }
+        ServerContext context{config, executor, shards, journal.get(), results.get()};
+        MCPServer server(context);
+#if defined(__linux__)
+        std::unique_ptr<ShmTransport> shm;
+        if (!config.shm_socket.empty()) {
+            shm = std::make_unique<ShmTransport>(context, shards[0].context());
+            std::cout << "Shared-memory transport on " << config.shm_socket << std::endl;
+        }
+#else
+        if (!config.shm_socket.empty()) {
+            std::cerr << "The shared-memory transport needs Linux; ignoring --shm-socket" << std::endl;
+        }
+#endif
         
-        std::cout << "MCP Server running on port " << port << std::endl;
+        std::cout << "MCP Server running on port " << config.port << std::endl;
+        std::cout << "Tool workers: " << executor.threadCount() << ", io shards: " << shards.size() << std::endl;
         std::cout << "Registered " << ToolRegistry::instance().getAllTools().size() << " tool(s)" << std::endl;
-        io_context.run();
+        shards.run(config, store.get());
     } catch (std::exception& e) {
         std::cerr << "Exception: " << e.what() << std::endl;
     }
 
     return 0;
 }
+#endif // CUSTOMMCP_NO_MAIN